@@ -0,0 +1,109 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace ospray {
+
+  /*! \brief single-file binary pkd container
+
+    \detailed A PKDFileHeader at offset 0, directly followed by
+    'numAttributes' PKDFileAttribute entries. All column sections
+    (positions, split planes, attributes) start at a multiple of
+    'alignment' (at least the page size), so the file can be mapped
+    and its columns used in place. All offsets are in bytes from the
+    start of the file. */
+
+  //! current version of the container format
+  const uint32_t PKD_FILE_VERSION = 2;
+  //! section alignment written by default
+  const uint32_t PKD_FILE_ALIGNMENT = 4096;
+
+  //! formats of the position section
+  enum PKDFilePositionFormat {
+    //! one vec3f per particle, split dim in the lower bits of x
+    PKD_POSITION_FLOAT3 = 0,
+    /*! one uint64 per particle, 20 bits per coordinate relative to
+        the quantization bounds (at bits 2, 22 and 42), split dim in
+        the lower two bits */
+    PKD_POSITION_QUANTIZED64 = 1,
+    /*! bucketed tree, x[],y[],z[] per bucket of 'bucketSize'
+        particles, with 'numInnerNodes' split planes in their own
+        section */
+    PKD_POSITION_BUCKETED_FLOAT = 2
+  };
+
+  struct PKDFileHeader {
+    //! "OSPPKD" followed by two zero bytes
+    char     magic[8];
+    uint32_t version;
+    //! size of the header plus the attribute table
+    uint32_t headerSize;
+    //! alignment of the column sections, in bytes
+    uint32_t alignment;
+    //! one of PKDFilePositionFormat
+    uint32_t positionFormat;
+    uint64_t numParticles;
+    uint64_t numInnerNodes;
+    //! bounds of the particle centers
+    float    bounds[6];
+    float    radius;
+    //! particles per leaf bucket, 0 for the classic layout
+    uint32_t bucketSize;
+    //! depth of the treelets the nodes are stored in, 0 for heap order
+    uint32_t treeletDepth;
+    uint32_t numAttributes;
+    //! bounds quantized positions are relative to
+    float    quantizationBounds[6];
+    //! bits per quantized coordinate
+    uint32_t quantizationBits;
+    uint32_t reserved;
+    uint64_t positionOfs, positionSize;
+    //! split planes of a bucketed tree, 0 if there are none
+    uint64_t splitPlaneOfs, splitPlaneSize;
+
+    PKDFileHeader()
+    {
+      memset(this,0,sizeof(*this));
+      memcpy(magic,"OSPPKD\0",8);
+      version   = PKD_FILE_VERSION;
+      alignment = PKD_FILE_ALIGNMENT;
+    }
+    bool isValid() const
+    { return memcmp(magic,"OSPPKD\0",8) == 0; }
+  };
+
+  /*! one entry of the attribute table, one value per particle: a
+      float, or for compact attributes an 8 or 16 bit unsigned integer
+      holding the value normalized to [lo,hi] */
+  struct PKDFileAttribute {
+    char     name[64];
+    uint64_t ofs, size;
+    //! range of the attribute's values
+    float    lo, hi;
+    //! bits per value, 32, 16 or 8
+    uint32_t bits;
+    uint32_t reserved;
+  };
+
+  //! round 'ofs' up to the next multiple of 'alignment'
+  inline uint64_t pkdFileAlign(uint64_t ofs, uint64_t alignment)
+  { return (ofs+alignment-1)/alignment*alignment; }
+
+}
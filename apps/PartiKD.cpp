@@ -15,10 +15,17 @@
 // ======================================================================== //
 
 #include "PartiKD.h"
+#include "PKDFile.h"
 #include "../ospray/MinMaxBVH2.h"
 
 #include "ospcommon/constants.h"
 #include "ospcommon/FileName.h"
+#include "ospray/common/tasking/parallel_for.h"
+
+#include <algorithm>
+#include <limits>
+#include <cstdio>
+#include <unistd.h>
 
 #define CHECK 1
 
@@ -39,6 +46,12 @@ namespace ospray {
 #endif
   }
 
+  int PartiKD::getDim(size_t ID) const
+  {
+    const vec3f &particle = this->model->position[ID];
+    return ((const int &)particle.x) & 3;
+  }
+
   struct SubtreeIterator {
     size_t curInLevel;
     size_t maxInLevel;
@@ -83,6 +96,49 @@ namespace ospray {
     return NULL;
   } 
 
+  struct PKDRefitJob {
+    const PartiKD *const pkd;
+    const size_t nodeID;
+    const box3f  bounds;
+    const size_t depth;
+    box3f        subtree;
+    std::vector<PartiKD::RebuildJob> rebuild;
+    __forceinline PKDRefitJob(const PartiKD *pkd, size_t nodeID, box3f bounds, size_t depth) 
+      : pkd(pkd), nodeID(nodeID), bounds(bounds), depth(depth), subtree(empty)
+    {};
+  };
+
+  void *pkdRefitThread(void *arg)
+  {
+    PKDRefitJob *job = (PKDRefitJob *)arg;
+    job->subtree = job->pkd->refitRec(job->nodeID,job->bounds,job->depth,job->rebuild);
+    return NULL;
+  } 
+
+  struct PKDBucketedBuildJob {
+    PartiKD *const pkd;
+    const size_t nodeID;
+    const size_t firstLeaf;
+    const box3f  bounds;
+    const size_t depth;
+    uint32 *const order;
+    std::vector<std::pair<size_t,size_t>> &bucketRange;
+    __forceinline PKDBucketedBuildJob(PartiKD *pkd, size_t nodeID, size_t firstLeaf, box3f bounds,
+                                      size_t depth, uint32 *order,
+                                      std::vector<std::pair<size_t,size_t>> &bucketRange) 
+      : pkd(pkd), nodeID(nodeID), firstLeaf(firstLeaf), bounds(bounds), depth(depth),
+        order(order), bucketRange(bucketRange)
+    {};
+  };
+
+  void *pkdBucketedBuildThread(void *arg)
+  {
+    PKDBucketedBuildJob *job = (PKDBucketedBuildJob *)arg;
+    job->pkd->buildBucketedRec(job->nodeID,job->firstLeaf,job->bounds,job->depth,
+                               job->order,job->bucketRange);
+    return NULL;
+  } 
+
   //#define FAST 1
 
 #if FAST
@@ -296,7 +352,7 @@ namespace ospray {
     lBounds.upper[dim] = rBounds.lower[dim] = pos(nodeID,dim);
 
 #if 1
-    if ((numLevels - depth) > 20) {
+    if (numLevels > depth + 20) {
       pthread_t lThread,rThread;
       pthread_create(&lThread,NULL,pkdBuildThread,new PKDBuildJob(this,leftChildOf(nodeID),lBounds,depth+1));
       buildRec(rightChildOf(nodeID),rBounds,depth+1);
@@ -317,18 +373,33 @@ namespace ospray {
       std::swap(model->attribute[i]->value[a],model->attribute[i]->value[b]);
     if (!model->type.empty())
       std::swap(model->type[a],model->type[b]);
+    if (!model->id.empty())
+      std::swap(model->id[a],model->id[b]);
   }
 
-  void PartiKD::build(ParticleModel *model) 
+  void PartiKD::init(ParticleModel *model)
   {
     assert(this->model == NULL);
     assert(model);
     this->model = model;
 
-
     assert(!model->position.empty());
     numParticles = model->position.size();
     assert(numParticles <= (1ULL << 31));
+    assert(model->id.empty() || model->id.size() == numParticles);
+
+    numInnerNodes = numInnerNodesOf(numParticles);
+
+    // determine num levels
+    numLevels = 0;
+    size_t nodeID = 0;
+    while (isValidNode(nodeID)) { ++numLevels; nodeID = leftChildOf(nodeID); }
+    treelets = TreeletLayout();
+  }
+
+  void PartiKD::build(ParticleModel *model) 
+  {
+    init(model);
 
 #if 0
     cout << "#osp:pkd: TEST: RANDOMIZING PARTICLES" << endl;
@@ -339,15 +410,321 @@ namespace ospray {
     cout << "#osp:pkd: RANDOMIZED" << endl;
 #endif
 
-    numInnerNodes = numInnerNodesOf(numParticles);
+    const box3f &bounds = model->getBounds();
+    buildRec(0,bounds,0);
+  }
 
-    // determine num levels
+  size_t PartiKD::subtreeSize(const size_t nodeID) const
+  {
+    return subtreeSize(nodeID,numParticles);
+  }
+
+  size_t PartiKD::subtreeSize(const size_t nodeID, const size_t numNodes)
+  {
+    size_t size = 0;
+    size_t first = nodeID, numInLevel = 1;
+    while (isValidNode(first,numNodes)) {
+      size += std::min(numInLevel,numNodes-first);
+      first = leftChildOf(first);
+      numInLevel += numInLevel;
+    }
+    return size;
+  }
+
+  box3f PartiKD::refitRec(const size_t nodeID,
+                          const box3f &bounds,
+                          const size_t depth,
+                          std::vector<RebuildJob> &rebuild) const
+  {
+    const vec3f &p = model->position[nodeID];
+    box3f subtree(p,p);
+    if (!hasLeftChild(nodeID))
+      return subtree;
+
+#if DIM_FROM_DEPTH
+    const size_t dim = depth % 3;
+#else
+    const size_t dim = getDim(nodeID);
+#endif
+    const float plane = pos(nodeID,dim);
+    box3f lBounds = bounds;
+    box3f rBounds = bounds;
+    lBounds.upper[dim] = rBounds.lower[dim] = plane;
+
+    const size_t numBefore = rebuild.size();
+    box3f l = empty, r = empty;
+    if ((numLevels - depth) > 20) {
+      PKDRefitJob lJob(this,leftChildOf(nodeID),lBounds,depth+1);
+      pthread_t lThread;
+      pthread_create(&lThread,NULL,pkdRefitThread,&lJob);
+      if (hasRightChild(nodeID))
+        r = refitRec(rightChildOf(nodeID),rBounds,depth+1,rebuild);
+      void *ret = NULL;
+      pthread_join(lThread,&ret);
+      l = lJob.subtree;
+      rebuild.insert(rebuild.end(),lJob.rebuild.begin(),lJob.rebuild.end());
+    } else {
+      l = refitRec(leftChildOf(nodeID),lBounds,depth+1,rebuild);
+      if (hasRightChild(nodeID))
+        r = refitRec(rightChildOf(nodeID),rBounds,depth+1,rebuild);
+    }
+    subtree.extend(l);
+    subtree.extend(r);
+
+    if (l.upper[dim] > plane || r.lower[dim] < plane) {
+      // kd-invariant broke at this node; the whole subtree gets
+      // rebuilt, so none of its descendants have to be
+      rebuild.resize(numBefore,RebuildJob(0,empty,0));
+      rebuild.push_back(RebuildJob(nodeID,bounds,depth));
+    }
+    return subtree;
+  }
+
+  float PartiKD::refit(ParticleModel *model, const ParticleModel &current)
+  {
+    init(model);
+    if (model->id.size() != numParticles)
+      throw std::runtime_error("#osp:pkd: refit requires a model with particle IDs");
+    if (current.position.size() != numParticles
+        || current.attribute.size() != model->attribute.size()
+        || current.type.size() != model->type.size())
+      throw std::runtime_error("#osp:pkd: refit requires the same set of particles");
+
+    // update the positions in place, in the previous tree order, but
+    // keep the split dims we already have
+    const size_t blockSize = 64*1024;
+    parallel_for(int((numParticles+blockSize-1)/blockSize), [&](int blockID) {
+      const size_t begin = blockID*blockSize;
+      const size_t end   = std::min(begin+blockSize,numParticles);
+      for (size_t i=begin;i<end;i++) {
+        const uint32 id = model->id[i];
+        const int dim = ((int &)model->position[i].x) & 3;
+        model->position[i] = current.position[id];
+        if (isInnerNode(i))
+          setDim(i,dim);
+        for (size_t a=0;a<model->attribute.size();a++)
+          model->attribute[a]->value[i] = current.attribute[a]->value[id];
+        if (!model->type.empty())
+          model->type[i] = current.type[id];
+      }
+    });
+    for (size_t a=0;a<model->attribute.size();a++) {
+      model->attribute[a]->minValue = current.attribute[a]->minValue;
+      model->attribute[a]->maxValue = current.attribute[a]->maxValue;
+    }
+
+    // find the topmost nodes whose kd-invariant broke ...
+    std::vector<RebuildJob> rebuild;
+    refitRec(0,model->getBounds(),0,rebuild);
+
+    // ... and rebuild only those subtrees
+    std::vector<size_t> numRebuilt(rebuild.size(),0);
+    parallel_for(int(rebuild.size()), [&](int jobID) {
+      const RebuildJob &job = rebuild[jobID];
+      buildRec(job.nodeID,job.bounds,job.depth);
+      numRebuilt[jobID] = subtreeSize(job.nodeID);
+    });
+
+    size_t totalRebuilt = 0;
+    for (size_t i=0;i<numRebuilt.size();i++)
+      totalRebuilt += numRebuilt[i];
+    return totalRebuilt / float(numParticles);
+  }
+
+  void PartiKD::buildBucketedRec(const size_t nodeID,
+                                 const size_t firstLeaf,
+                                 const box3f &bounds,
+                                 const size_t depth,
+                                 uint32 *order,
+                                 std::vector<std::pair<size_t,size_t>> &bucketRange)
+  {
+    // the tree is a full binary tree over all buckets, so every inner
+    // node has two children. particles get distributed evenly over
+    // the leaves (in spatial order), so every bucket gets at least
+    // one, and at most 'bucketSize' particles
+    const size_t numInput   = model->position.size();
+    const size_t numBuckets = numInnerNodes+1;
+    const size_t numNodes   = 2*numBuckets-1;
+    const size_t numLeaves  = (subtreeSize(nodeID,numNodes)+1)/2;
+    const size_t begin = (numInput*firstLeaf)/numBuckets;
+    const size_t end   = (numInput*(firstLeaf+numLeaves))/numBuckets;
+
+    if (nodeID >= numInnerNodes) {
+      bucketRange[nodeID-numInnerNodes] = std::make_pair(begin,end);
+      return;
+    }
+
+#if DIM_ROUND_ROBIN
+    const size_t dim = depth % 3;
+#else
+    const size_t dim = maxDim(bounds.size());
+#endif
+    const size_t numLeftLeaves = (subtreeSize(leftChildOf(nodeID),numNodes)+1)/2;
+    const size_t mid = (numInput*(firstLeaf+numLeftLeaves))/numBuckets;
+    const std::vector<vec3f> &position = model->position;
+    std::nth_element(order+begin,order+mid,order+end,[&](uint32 a, uint32 b) {
+        return position[a][dim] < position[b][dim];
+      });
+
+    // note that storing the split dim in the plane's mantissa moves
+    // the plane by a few ulps, which traversal covers by the radius
+    float plane = position[order[mid]][dim];
+    int &planeAsInt = (int &)plane;
+    planeAsInt = (planeAsInt & ~3) | dim;
+    splitPlane[nodeID] = plane;
+
+    box3f lBounds = bounds;
+    box3f rBounds = bounds;
+    lBounds.upper[dim] = rBounds.lower[dim] = position[order[mid]][dim];
+
+    if ((end - begin) > (1<<20)) {
+      PKDBucketedBuildJob lJob(this,leftChildOf(nodeID),firstLeaf,lBounds,depth+1,
+                               order,bucketRange);
+      pthread_t lThread;
+      pthread_create(&lThread,NULL,pkdBucketedBuildThread,&lJob);
+      buildBucketedRec(rightChildOf(nodeID),firstLeaf+numLeftLeaves,rBounds,depth+1,
+                       order,bucketRange);
+      void *ret = NULL;
+      pthread_join(lThread,&ret);
+    } else {
+      buildBucketedRec(leftChildOf(nodeID),firstLeaf,lBounds,depth+1,order,bucketRange);
+      buildBucketedRec(rightChildOf(nodeID),firstLeaf+numLeftLeaves,rBounds,depth+1,
+                       order,bucketRange);
+    }
+  }
+
+  template<typename T>
+  static void gatherBuckets(std::vector<T> &value,
+                            const std::vector<uint32> &order,
+                            const std::vector<std::pair<size_t,size_t>> &bucketRange,
+                            const size_t bucketSize)
+  {
+    std::vector<T> bucketed(bucketRange.size()*bucketSize);
+    parallel_for(int(bucketRange.size()), [&](int bucketID) {
+      const size_t begin = bucketRange[bucketID].first;
+      const size_t count = bucketRange[bucketID].second - begin;
+      for (size_t i=0;i<bucketSize;i++)
+        bucketed[bucketID*bucketSize+i] = value[order[begin+std::min(i,count-1)]];
+    });
+    value.swap(bucketed);
+  }
+
+  void PartiKD::buildBucketed(ParticleModel *model, size_t bucketSize)
+  {
+    init(model);
+    assert(bucketSize > 0);
+    this->bucketSize = bucketSize;
+
+    const size_t numBuckets = (numParticles+bucketSize-1)/bucketSize;
+    numInnerNodes = numBuckets-1;
     numLevels = 0;
-    size_t nodeID = 0;
-    while (isValidNode(nodeID)) { ++numLevels; nodeID = leftChildOf(nodeID); }
+    for (size_t nodeID=0;isValidNode(nodeID,2*numBuckets-1);nodeID=leftChildOf(nodeID))
+      ++numLevels;
+    splitPlane.resize(numInnerNodes);
 
-    const box3f &bounds = model->getBounds();
-    buildRec(0,bounds,0);
+    std::vector<uint32> order(numParticles);
+    for (size_t i=0;i<numParticles;i++)
+      order[i] = i;
+    std::vector<std::pair<size_t,size_t>> bucketRange(numBuckets);
+    buildBucketedRec(0,0,model->getBounds(),0,&order[0],bucketRange);
+
+    gatherBuckets(model->position,order,bucketRange,bucketSize);
+    for (size_t i=0;i<model->attribute.size();i++)
+      gatherBuckets(model->attribute[i]->value,order,bucketRange,bucketSize);
+    if (!model->type.empty())
+      gatherBuckets(model->type,order,bucketRange,bucketSize);
+    if (!model->id.empty())
+      gatherBuckets(model->id,order,bucketRange,bucketSize);
+    numParticles = model->position.size();
+  }
+
+  //! quantize one coordinate to 20 bits relative to [lo,hi]
+  static uint64 quantizeCoord(const float f, const float lo, const float hi)
+  {
+    if (!(hi > lo)) return 0;
+    const float i = (1<<20) * (f-lo) / (hi-lo);
+    return uint64(std::max(0.f,std::min(i,float((1<<20)-1))));
+  }
+
+  /*! quantize p to 20 bits per coordinate relative to 'bounds',
+      keeping the split dim in the lower two bits */
+  static uint64 quantizePosition(const vec3f &p, const box3f &bounds)
+  {
+    uint64 dim = ((int&)p.x) & 3;
+    uint64 ix = quantizeCoord(p.x,bounds.lower.x,bounds.upper.x);
+    uint64 iy = quantizeCoord(p.y,bounds.lower.y,bounds.upper.y);
+    uint64 iz = quantizeCoord(p.z,bounds.lower.z,bounds.upper.z);
+    return (ix << 2) | (iy << 22) | (iz << 42) | dim;
+  }
+
+  std::vector<uint64> PartiKD::quantizedPositions(const box3f &bounds) const
+  {
+    assert(bucketSize == 0);
+    std::vector<uint64> quantized(numParticles);
+    for (size_t i=0;i<numParticles;i++)
+      quantized[i] = quantizePosition(model->position[i],bounds);
+    return quantized;
+  }
+
+  std::vector<float> PartiKD::bucketPositionsSoA() const
+  {
+    assert(bucketSize > 0);
+    std::vector<float> soa(3*numParticles);
+    for (size_t i=0;i<numParticles;i++) {
+      float *bucket = &soa[3*bucketSize*(i/bucketSize)];
+      const size_t lane = i % bucketSize;
+      const vec3f &p = model->position[i];
+      bucket[lane]              = p.x;
+      bucket[bucketSize+lane]   = p.y;
+      bucket[2*bucketSize+lane] = p.z;
+    }
+    return soa;
+  }
+
+  TreeletLayout::TreeletLayout(const size_t numNodes, const int depth)
+    : depth(depth), lastBandBegin(0), lastBandLevels(0), numFullLast(0), lastPartialSize(0)
+  {
+    if (!depth || !numNodes) return;
+    const int numLevels = depthOf(numNodes-1)+1;
+    lastBandBegin  = ((numLevels-1)/depth)*depth;
+    lastBandLevels = numLevels-lastBandBegin;
+    // nodes on the deepest level, and how many of them a treelet of
+    // the last band can hold
+    const size_t numDeepest = numNodes - ((size_t(1)<<(numLevels-1))-1);
+    const size_t deepestPerTreelet = size_t(1)<<(lastBandLevels-1);
+    numFullLast     = numDeepest / deepestPerTreelet;
+    lastPartialSize = (deepestPerTreelet-1) + numDeepest % deepestPerTreelet;
+  }
+
+  template<typename T>
+  static void scatterTreelets(std::vector<T> &value, const TreeletLayout &treelets)
+  {
+    std::vector<T> reordered(value.size());
+    parallel_for(int((value.size()+(64*1024)-1)/(64*1024)), [&](int blockID) {
+      const size_t begin = blockID*size_t(64*1024);
+      const size_t end   = std::min(begin+64*1024,value.size());
+      for (size_t i=begin;i<end;i++)
+        reordered[treelets.storageIndex(i)] = value[i];
+    });
+    value.swap(reordered);
+  }
+
+  void PartiKD::reorderTreelets(int depth)
+  {
+    if (bucketSize)
+      throw std::runtime_error("#osp:pkd: treelet order is not supported for bucketed trees");
+    if (treelets.depth)
+      throw std::runtime_error("#osp:pkd: tree is already in treelet order");
+    treelets = TreeletLayout(numParticles,depth);
+    if (!depth) return;
+
+    scatterTreelets(model->position,treelets);
+    for (size_t i=0;i<model->attribute.size();i++)
+      scatterTreelets(model->attribute[i]->value,treelets);
+    if (!model->type.empty())
+      scatterTreelets(model->type,treelets);
+    if (!model->id.empty())
+      scatterTreelets(model->id,treelets);
   }
 
   //! save to xml+binary file(s)
@@ -394,6 +771,8 @@ namespace ospray {
 
   void PartiKD::saveOSPQuantized(FILE *xml, FILE *bin)
   {
+    if (bucketSize)
+      throw std::runtime_error("#osp:pkd: quantized bucketed trees are not supported");
     printf("#osp:pkd: writing quantized version");
     fprintf(xml,"<PKDGeometry>\n");
       // fprintf(xml,"<Renderer type=\"PKDSplatter\" name=\"splat\">\n");
@@ -404,23 +783,18 @@ namespace ospray {
     // fprintf(xml,"<data name=\"particles\" ofs=\"%li\" count=\"%li\" format=\"uint64\"/>\n",
             ftell(bin),numParticles);
     for (int i=0;i<model->position.size();i++) {
-      vec3f p = model->position[i];
-      uint64 dim = ((int&)p.x) & 3;
-      
-      uint64 ix = uint64((1<<20) * (p.x-bounds.lower.x) / (bounds.upper.x-bounds.lower.x));
-      uint64 iy = uint64((1<<20) * (p.y-bounds.lower.y) / (bounds.upper.y-bounds.lower.y));
-      uint64 iz = uint64((1<<20) * (p.z-bounds.lower.z) / (bounds.upper.z-bounds.lower.z));
-      
-      ix = std::max(std::min(ix,((uint64)1<<20)-1),(uint64)0);
-      iy = std::max(std::min(iy,((uint64)1<<20)-1),(uint64)0);
-      iz = std::max(std::min(iz,((uint64)1<<20)-1),(uint64)0);
-      
-      uint64 quantized = (ix << 2) | (iy << 22) | (iz << 42) | dim;
+      uint64 quantized = quantizePosition(model->position[i],bounds);
       fwrite(&quantized,sizeof(quantized),1,bin);
     }
 
+    fprintf(xml,"<quantizationLower value=\"%f %f %f\"/>\n",
+            bounds.lower.x,bounds.lower.y,bounds.lower.z);
+    fprintf(xml,"<quantizationUpper value=\"%f %f %f\"/>\n",
+            bounds.upper.x,bounds.upper.y,bounds.upper.z);
     if (model->radius > 0.)
       fprintf(xml,"<radius>%f</radius>\n",model->radius);
+    if (treelets.depth)
+      fprintf(xml,"<treeletDepth value=\"%i\"/>\n",treelets.depth);
     fprintf(xml,"<useOldAlphaSpheresCode value=\"0\"/>\n");
     fprintf(xml,"</PKDGeometry>\n");
   }
@@ -430,9 +804,21 @@ namespace ospray {
   {
     fprintf(xml,"<PKDGeometry>\n");
 
-    fprintf(xml,"<position ofs=\"%li\" count=\"%li\" format=\"vec3f\"/>\n",
-            ftell(bin),numParticles);
-    fwrite(&model->position[0],sizeof(ParticleModel::vec_t),numParticles,bin);
+    if (bucketSize) {
+      const std::vector<float> soa = bucketPositionsSoA();
+      fprintf(xml,"<position ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
+              ftell(bin),soa.size());
+      fwrite(&soa[0],sizeof(float),soa.size(),bin);
+      fprintf(xml,"<splitPlane ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
+              ftell(bin),splitPlane.size());
+      if (!splitPlane.empty())
+        fwrite(&splitPlane[0],sizeof(float),splitPlane.size(),bin);
+      fprintf(xml,"<bucketSize value=\"%li\"/>\n",bucketSize);
+    } else {
+      fprintf(xml,"<position ofs=\"%li\" count=\"%li\" format=\"vec3f\"/>\n",
+              ftell(bin),numParticles);
+      fwrite(&model->position[0],sizeof(ParticleModel::vec_t),numParticles,bin);
+    }
     for (int i=0;i<model->attribute.size();i++) {
       ParticleModel::Attribute *attr = model->attribute[i];
       fprintf(xml,"<attribute name=\"%s\" ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
@@ -449,11 +835,509 @@ namespace ospray {
     }
     if (model->radius > 0.)
       fprintf(xml,"<radius>%f</radius>\n",model->radius);
+    if (treelets.depth)
+      fprintf(xml,"<treeletDepth value=\"%i\"/>\n",treelets.depth);
     fprintf(xml,"<useOldAlphaSpheresCode value=\"0\"/>\n");
     fprintf(xml,"</PKDGeometry>\n");
 
     // fprintf(xml,"<Renderer type=\"ao1\" name=\"default\">\n");
     // fprintf(xml,"</Renderer>\n");
   }
-}
 
+  //! write 'size' bytes at 'ofs' of the given container file
+  static void writeSection(FILE *file, const uint64 ofs, const void *data, const size_t size)
+  {
+    if (fseeko(file,ofs,SEEK_SET) != 0 || (size && fwrite(data,1,size,file) != size))
+      throw std::runtime_error("#osp:pkd: error writing pkd container");
+  }
+
+  std::vector<uint8> compactAttribute(const std::vector<float> &value,
+                                      const float lo, const float hi, const int bits)
+  {
+    if (bits != 8 && bits != 16)
+      throw std::runtime_error("#osp:pkd: compact attributes have 8 or 16 bits");
+    const float maxValue = float((1<<bits)-1);
+    const float scale = hi > lo ? maxValue/(hi-lo) : 0.f;
+    std::vector<uint8> compact(value.size()*(bits/8));
+    for (size_t i=0;i<value.size();i++) {
+      const float f = std::max(0.f,std::min(maxValue,(value[i]-lo)*scale+.5f));
+      if (bits == 8)
+        compact[i] = uint8(f);
+      else
+        ((uint16*)compact.data())[i] = uint16(f);
+    }
+    return compact;
+  }
+
+  void PartiKD::saveContainer(const std::string &fileName, bool quantized, int attributeBits)
+  {
+    if (quantized && bucketSize)
+      throw std::runtime_error("#osp:pkd: quantized bucketed trees are not supported");
+    if (attributeBits != 8 && attributeBits != 16 && attributeBits != 32)
+      throw std::runtime_error("#osp:pkd: attributes have 8, 16 or 32 bits");
+    FILE *file = fopen(fileName.c_str(),"wb");
+    if (!file)
+      throw std::runtime_error("#osp:pkd: could not open '"+fileName+"' for writing");
+
+    const box3f bounds = model->getBounds();
+    PKDFileHeader header;
+    header.numParticles  = numParticles;
+    header.numInnerNodes = numInnerNodes;
+    (vec3f&)header.bounds[0] = bounds.lower;
+    (vec3f&)header.bounds[3] = bounds.upper;
+    header.radius        = model->radius;
+    header.bucketSize    = bucketSize;
+    header.treeletDepth  = treelets.depth;
+    header.numAttributes = model->attribute.size() + (model->type.empty() ? 0 : 1);
+    header.headerSize    = sizeof(PKDFileHeader) + header.numAttributes*sizeof(PKDFileAttribute);
+
+    // lay out the sections, each starting on an aligned offset
+    uint64 ofs = header.headerSize;
+    auto section = [&](uint64 &sectionOfs, uint64 &sectionSize, const uint64 size) {
+      sectionOfs  = pkdFileAlign(ofs,header.alignment);
+      sectionSize = size;
+      ofs = sectionOfs + size;
+    };
+    if (bucketSize) {
+      header.positionFormat = PKD_POSITION_BUCKETED_FLOAT;
+      section(header.positionOfs,header.positionSize,3*numParticles*sizeof(float));
+      section(header.splitPlaneOfs,header.splitPlaneSize,splitPlane.size()*sizeof(float));
+    } else if (quantized) {
+      header.positionFormat = PKD_POSITION_QUANTIZED64;
+      header.quantizationBits = 20;
+      memcpy(header.quantizationBounds,header.bounds,sizeof(header.bounds));
+      section(header.positionOfs,header.positionSize,numParticles*sizeof(uint64));
+    } else {
+      header.positionFormat = PKD_POSITION_FLOAT3;
+      section(header.positionOfs,header.positionSize,numParticles*sizeof(vec3f));
+    }
+    std::vector<PKDFileAttribute> attribute(header.numAttributes);
+    for (size_t i=0;i<attribute.size();i++) {
+      // atom types are kept as they are
+      const bool isType = i >= model->attribute.size();
+      const std::string name = isType ? "atomType" : model->attribute[i]->name;
+      memset(&attribute[i],0,sizeof(attribute[i]));
+      strncpy(attribute[i].name,name.c_str(),sizeof(attribute[i].name)-1);
+      attribute[i].bits = isType ? 32 : attributeBits;
+      section(attribute[i].ofs,attribute[i].size,numParticles*(attribute[i].bits/8));
+    }
+
+    if (bucketSize) {
+      const std::vector<float> soa = bucketPositionsSoA();
+      writeSection(file,header.positionOfs,soa.data(),header.positionSize);
+      writeSection(file,header.splitPlaneOfs,splitPlane.data(),header.splitPlaneSize);
+    } else if (quantized) {
+      const std::vector<uint64> quantized = quantizedPositions(bounds);
+      writeSection(file,header.positionOfs,quantized.data(),header.positionSize);
+    } else {
+      writeSection(file,header.positionOfs,model->position.data(),header.positionSize);
+    }
+    for (size_t i=0;i<attribute.size();i++) {
+      std::vector<float> value;
+      if (i < model->attribute.size())
+        value = model->attribute[i]->value;
+      else
+        value.assign(model->type.begin(),model->type.end());
+      attribute[i].lo = attribute[i].hi = value.empty() ? 0.f : value[0];
+      for (const float v : value) {
+        attribute[i].lo = std::min(attribute[i].lo,v);
+        attribute[i].hi = std::max(attribute[i].hi,v);
+      }
+      if (attribute[i].bits == 32) {
+        writeSection(file,attribute[i].ofs,value.data(),attribute[i].size);
+      } else {
+        const std::vector<uint8> compact
+          = compactAttribute(value,attribute[i].lo,attribute[i].hi,attribute[i].bits);
+        writeSection(file,attribute[i].ofs,compact.data(),attribute[i].size);
+      }
+    }
+    // header last, so an interrupted write doesn't leave a valid file
+    writeSection(file,sizeof(PKDFileHeader),attribute.data(),
+                 attribute.size()*sizeof(PKDFileAttribute));
+    writeSection(file,0,&header,sizeof(header));
+    fclose(file);
+  }
+
+  // -------------------------------------------------------
+  // external-memory builder
+  // -------------------------------------------------------
+
+  OutOfCorePartiKD::OutOfCorePartiKD(size_t memoryBudget, const std::string &tmpDir)
+    : memoryBudget(memoryBudget), tmpDir(tmpDir), numParticles(0), bounds(empty),
+      hasType(false), rootFile(NULL), bin(NULL), numBucketFiles(0)
+  {}
+
+  OutOfCorePartiKD::~OutOfCorePartiKD()
+  {
+    if (rootFile) {
+      fclose(rootFile);
+      remove(rootBucket.c_str());
+    }
+    if (bin)
+      fclose(bin);
+  }
+
+  std::string OutOfCorePartiKD::newBucketFileName()
+  {
+    char name[128];
+    sprintf(name,"/pkd-bucket-%i-%li.bin",(int)getpid(),numBucketFiles++);
+    return tmpDir+name;
+  }
+
+  size_t OutOfCorePartiKD::ioChunkSize() const
+  {
+    // stay well below the budget even with a read and two write
+    // buffers in flight
+    return std::max(size_t(1024),std::min(size_t(1)<<20,memoryBudget/(8*recordBytes())));
+  }
+
+  /*! stream the 'numRecords' records of 'stride' floats in the given
+      bucket file through 'func', 'chunkSize' records at a time */
+  template<typename Func>
+  static void forEachRecord(const std::string &bucket, const size_t numRecords,
+                            const size_t stride, const size_t chunkSize, const Func &func)
+  {
+    FILE *file = fopen(bucket.c_str(),"rb");
+    if (!file)
+      throw std::runtime_error("#osp:pkd: could not open bucket file '"+bucket+"'");
+    std::vector<float> chunk(chunkSize*stride);
+    for (size_t begin=0;begin<numRecords;begin+=chunkSize) {
+      const size_t count = std::min(chunkSize,numRecords-begin);
+      if (fread(&chunk[0],sizeof(float)*stride,count,file) != count) {
+        fclose(file);
+        throw std::runtime_error("#osp:pkd: could not read bucket file '"+bucket+"'");
+      }
+      for (size_t i=0;i<count;i++)
+        func(&chunk[i*stride]);
+    }
+    fclose(file);
+  }
+
+  //! buffered writer of particle records to a bucket file
+  struct BucketWriter {
+    BucketWriter(const std::string &fileName, size_t stride, size_t chunkSize)
+      : file(fopen(fileName.c_str(),"wb")), stride(stride), chunkSize(chunkSize)
+    {
+      if (!file)
+        throw std::runtime_error("#osp:pkd: could not create bucket file '"+fileName+"'");
+      buffer.reserve(chunkSize*stride);
+    }
+    ~BucketWriter() { flush(); fclose(file); }
+
+    void push(const float *record)
+    {
+      buffer.insert(buffer.end(),record,record+stride);
+      if (buffer.size() >= chunkSize*stride)
+        flush();
+    }
+    void flush()
+    {
+      if (!buffer.empty() && fwrite(&buffer[0],sizeof(float),buffer.size(),file) != buffer.size())
+        throw std::runtime_error("#osp:pkd: could not write bucket file");
+      buffer.clear();
+    }
+
+    FILE *file;
+    const size_t stride, chunkSize;
+    std::vector<float> buffer;
+  };
+
+  void OutOfCorePartiKD::addParticles(const ParticleModel &model)
+  {
+    if (model.position.empty())
+      return;
+
+    if (!rootFile) {
+      // the first model defines the layout of the particle records
+      for (size_t i=0;i<model.attribute.size();i++)
+        attributeName.push_back(model.attribute[i]->name);
+      hasType = !model.type.empty();
+      rootBucket = newBucketFileName();
+      rootFile = fopen(rootBucket.c_str(),"wb");
+      if (!rootFile)
+        throw std::runtime_error("#osp:pkd: could not create bucket file '"+rootBucket+"'");
+    } else {
+      bool sameLayout = model.attribute.size() == attributeName.size()
+        && model.type.empty() != hasType;
+      for (size_t i=0;sameLayout && i<attributeName.size();i++)
+        sameLayout = model.attribute[i]->name == attributeName[i];
+      if (!sameLayout)
+        throw std::runtime_error("#osp:pkd: all inputs need the same attributes for out-of-core builds");
+    }
+
+    const size_t stride = recordFloats();
+    const size_t chunkSize = ioChunkSize();
+    std::vector<float> chunk;
+    chunk.reserve(chunkSize*stride);
+    for (size_t i=0;i<model.position.size();i++) {
+      const vec3f &p = model.position[i];
+      bounds.extend(p);
+      chunk.push_back(p.x);
+      chunk.push_back(p.y);
+      chunk.push_back(p.z);
+      for (size_t a=0;a<attributeName.size();a++)
+        chunk.push_back(model.attribute[a]->value[i]);
+      if (hasType)
+        chunk.push_back(model.type[i]);
+      if (chunk.size() >= chunkSize*stride || i+1 == model.position.size()) {
+        if (fwrite(&chunk[0],sizeof(float),chunk.size(),rootFile) != chunk.size())
+          throw std::runtime_error("#osp:pkd: could not write bucket file '"+rootBucket+"'");
+        chunk.clear();
+      }
+    }
+    numParticles += model.position.size();
+  }
+
+  void OutOfCorePartiKD::writeNodes(const size_t nodeID, const float *record, const size_t count)
+  {
+    // the output has the same layout as PartiKD::saveOSP writes: all
+    // positions, then one column per attribute, then the types
+    const size_t stride = recordFloats();
+    std::vector<float> column(3*count);
+    for (size_t i=0;i<count;i++)
+      for (int d=0;d<3;d++)
+        column[3*i+d] = record[i*stride+d];
+    fseeko(bin,off_t(nodeID*sizeof(vec3f)),SEEK_SET);
+    if (fwrite(&column[0],sizeof(vec3f),count,bin) != count)
+      throw std::runtime_error("#osp:pkd: could not write output");
+
+    for (size_t c=3;c<stride;c++) {
+      for (size_t i=0;i<count;i++)
+        column[i] = record[i*stride+c];
+      const size_t columnOfs = numParticles*(sizeof(vec3f)+(c-3)*sizeof(float));
+      fseeko(bin,off_t(columnOfs+nodeID*sizeof(float)),SEEK_SET);
+      if (fwrite(&column[0],sizeof(float),count,bin) != count)
+        throw std::runtime_error("#osp:pkd: could not write output");
+    }
+  }
+
+  void OutOfCorePartiKD::selectSplit(const std::string &bucket, const size_t numInBucket,
+                                     const int dim, const box3f &bounds, const size_t k,
+                                     float &plane, size_t &numEqualBelow) const
+  {
+    // narrow down the range of coordinates the particle of rank k is
+    // in with histograms, until the particles in that range fit in
+    // memory (or all have the same coordinate). each level of the
+    // histogram path gets re-applied on every pass over the bucket
+    static const int numBins = 1<<12;
+    struct BinLevel { float lo, hi; int bin; };
+    std::vector<BinLevel> path;
+    auto binOf = [](float v, float lo, float hi) {
+      return std::min(numBins-1,std::max(0,int(numBins*((v-lo)/(hi-lo)))));
+    };
+    auto inRange = [&](float v) {
+      for (size_t i=0;i<path.size();i++)
+        if (binOf(v,path[i].lo,path[i].hi) != path[i].bin) return false;
+      return true;
+    };
+
+    const size_t stride = recordFloats();
+    float lo = bounds.lower[dim], hi = bounds.upper[dim];
+    size_t numBelow = 0, numInRange = numInBucket;
+    while (1) {
+      if (lo == hi) {
+        plane = lo;
+        numEqualBelow = k-numBelow;
+        return;
+      }
+      if (numInRange*sizeof(float) <= memoryBudget/2) {
+        std::vector<float> value;
+        value.reserve(numInRange);
+        forEachRecord(bucket,numInBucket,stride,ioChunkSize(),[&](const float *record) {
+          if (inRange(record[dim])) value.push_back(record[dim]);
+        });
+        std::nth_element(value.begin(),value.begin()+(k-numBelow),value.end());
+        plane = value[k-numBelow];
+        size_t numLess = 0;
+        for (size_t i=0;i<value.size();i++)
+          if (value[i] < plane) ++numLess;
+        numEqualBelow = k-numBelow-numLess;
+        return;
+      }
+
+      std::vector<size_t> count(numBins,0);
+      std::vector<float> binLo(numBins,+std::numeric_limits<float>::infinity());
+      std::vector<float> binHi(numBins,-std::numeric_limits<float>::infinity());
+      forEachRecord(bucket,numInBucket,stride,ioChunkSize(),[&](const float *record) {
+        const float v = record[dim];
+        if (!inRange(v)) return;
+        const int b = binOf(v,lo,hi);
+        ++count[b];
+        binLo[b] = std::min(binLo[b],v);
+        binHi[b] = std::max(binHi[b],v);
+      });
+      int b = 0;
+      while (numBelow+count[b] <= k) numBelow += count[b++];
+      path.push_back({lo,hi,b});
+      numInRange = count[b];
+      lo = binLo[b];
+      hi = binHi[b];
+    }
+  }
+
+  void OutOfCorePartiKD::buildInMemory(const std::string &bucket, const size_t nodeID,
+                                       const box3f &bounds, const size_t depth)
+  {
+    const size_t n = PartiKD::subtreeSize(nodeID,numParticles);
+    ParticleModel model;
+    model.position.resize(n);
+    for (size_t a=0;a<attributeName.size();a++)
+      model.getAttribute(attributeName[a])->value.resize(n);
+    if (hasType)
+      model.type.resize(n);
+
+    const size_t stride = recordFloats();
+    size_t i = 0;
+    forEachRecord(bucket,n,stride,ioChunkSize(),[&](const float *record) {
+      model.position[i] = vec3f(record[0],record[1],record[2]);
+      for (size_t a=0;a<attributeName.size();a++)
+        model.attribute[a]->value[i] = record[3+a];
+      if (hasType)
+        model.type[i] = int(record[stride-1]);
+      ++i;
+    });
+    remove(bucket.c_str());
+
+    // the subtree of nodeID has the same shape as a tree over its n
+    // particles, so build that one (with the global depth, for the
+    // split dims) ...
+    PartiKD pkd;
+    pkd.init(&model);
+    pkd.buildRec(0,bounds,depth);
+
+    // ... and write it out level by level, each level of the subtree
+    // is one contiguous range of nodes in the full tree
+    const size_t chunkSize = ioChunkSize();
+    std::vector<float> record(chunkSize*stride);
+    for (size_t first=0,numInLevel=1,level=0;first<n;
+         first=PartiKD::leftChildOf(first),numInLevel*=2,++level) {
+      const size_t levelSize = std::min(numInLevel,n-first);
+      for (size_t begin=0;begin<levelSize;begin+=chunkSize) {
+        const size_t count = std::min(chunkSize,levelSize-begin);
+        for (size_t j=0;j<count;j++) {
+          const size_t i = first+begin+j;
+          float *r = &record[j*stride];
+          const vec3f &p = model.position[i];
+          r[0] = p.x; r[1] = p.y; r[2] = p.z;
+          for (size_t a=0;a<attributeName.size();a++)
+            r[3+a] = model.attribute[a]->value[i];
+          if (hasType)
+            r[stride-1] = model.type[i];
+        }
+        writeNodes(((nodeID+1)<<level)-1+begin,&record[0],count);
+      }
+    }
+  }
+
+  void OutOfCorePartiKD::buildRec(const std::string &bucket, const size_t nodeID,
+                                  const box3f &bounds, const size_t depth)
+  {
+    const size_t n = PartiKD::subtreeSize(nodeID,numParticles);
+    if (n*recordBytes() <= memoryBudget && n < (1ULL << 31)) {
+      buildInMemory(bucket,nodeID,bounds,depth);
+      return;
+    }
+
+#if DIM_ROUND_ROBIN
+    const size_t dim = depth % 3;
+#else
+    const size_t dim = maxDim(bounds.size());
+#endif
+    const size_t lChild = PartiKD::leftChildOf(nodeID);
+    const size_t rChild = PartiKD::rightChildOf(nodeID);
+    const size_t numLeft = PartiKD::subtreeSize(lChild,numParticles);
+
+    float plane;
+    size_t numEqualLeft;
+    selectSplit(bucket,n,dim,bounds,numLeft,plane,numEqualLeft);
+
+    // split the bucket: the particle of rank numLeft becomes this
+    // node, the ones below it go left, the others right
+    const size_t stride = recordFloats();
+    const std::string lBucket = newBucketFileName();
+    const std::string rBucket = newBucketFileName();
+    std::vector<float> root(stride);
+    {
+      BucketWriter l(lBucket,stride,ioChunkSize());
+      BucketWriter r(rBucket,stride,ioChunkSize());
+      size_t numEqual = 0;
+      forEachRecord(bucket,n,stride,ioChunkSize(),[&](const float *record) {
+        const float v = record[dim];
+        if (v < plane)
+          l.push(record);
+        else if (v > plane)
+          r.push(record);
+        else {
+          if (numEqual < numEqualLeft)
+            l.push(record);
+          else if (numEqual == numEqualLeft)
+            std::copy(record,record+stride,root.begin());
+          else
+            r.push(record);
+          ++numEqual;
+        }
+      });
+    }
+    remove(bucket.c_str());
+
+    // store the split dim in the lower bits of x, like PartiKD::setDim
+    int &xAsInt = (int &)root[0];
+    xAsInt = (xAsInt & ~3) | int(dim);
+    writeNodes(nodeID,&root[0],1);
+
+    box3f lBounds = bounds;
+    box3f rBounds = bounds;
+    lBounds.upper[dim] = rBounds.lower[dim] = root[dim];
+
+    buildRec(lBucket,lChild,lBounds,depth+1);
+    if (PartiKD::isValidNode(rChild,numParticles))
+      buildRec(rBucket,rChild,rBounds,depth+1);
+    else
+      remove(rBucket.c_str());
+  }
+
+  void OutOfCorePartiKD::build(const std::string &fileName, float radius)
+  {
+    if (!rootFile)
+      throw std::runtime_error("#osp:pkd: no particles to build over");
+    fclose(rootFile);
+    rootFile = NULL;
+
+    const std::string binFileName = fileName + "bin";
+    bin = fopen(binFileName.c_str(),"wb");
+    if (!bin)
+      throw std::runtime_error("#osp:pkd: could not create '"+binFileName+"'");
+    buildRec(rootBucket,0,bounds,0);
+    fclose(bin);
+    bin = NULL;
+
+    saveOSPHeader(fileName,numParticles,attributeName,hasType,radius);
+  }
+
+  void saveOSPHeader(const std::string &fileName, const size_t numParticles,
+                     const std::vector<std::string> &attributeName,
+                     const bool hasType, const float radius)
+  {
+    FILE *xml = fopen(fileName.c_str(),"w");
+    if (!xml)
+      throw std::runtime_error("#osp:pkd: could not create '"+fileName+"'");
+    fprintf(xml,"<?xml version=\"1.0\"?>\n");
+    fprintf(xml,"<OSPRay>\n");
+    fprintf(xml,"<PKDGeometry>\n");
+    fprintf(xml,"<position ofs=\"%li\" count=\"%li\" format=\"vec3f\"/>\n",
+            0L,numParticles);
+    size_t ofs = numParticles*sizeof(vec3f);
+    for (size_t a=0;a<attributeName.size();a++,ofs+=numParticles*sizeof(float))
+      fprintf(xml,"<attribute name=\"%s\" ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
+              attributeName[a].c_str(),ofs,numParticles);
+    if (hasType)
+      fprintf(xml,"<attribute name=\"atomType\" ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
+              ofs,numParticles);
+    if (radius > 0.)
+      fprintf(xml,"<radius>%f</radius>\n",radius);
+    fprintf(xml,"<useOldAlphaSpheresCode value=\"0\"/>\n");
+    fprintf(xml,"</PKDGeometry>\n");
+    fprintf(xml,"</OSPRay>\n");
+    fclose(xml);
+  }
+}
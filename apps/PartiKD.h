@@ -21,6 +21,58 @@
 
 namespace ospray {
 
+  /*! \brief index arithmetic for storing an implicit pkd in treelet order
+
+    \detailed The heap-ordered tree is cut into bands of 'depth'
+    levels each; the part of a band below a given node (a "treelet")
+    is stored contiguously and in breadth-first order, so a descent
+    stays within a few cache lines and pages for 'depth' steps.
+    Bands are stored top to bottom, the treelets of a band left to
+    right. Only the deepest level of a pkd can be incomplete, which
+    only affects the treelets of the last band: the first
+    'numFullLast' of them are complete, the next one holds the
+    remaining nodes of the deepest level, and all others lack the
+    deepest level. A depth of 0 means plain heap order. */
+  struct TreeletLayout {
+    TreeletLayout()
+      : depth(0), lastBandBegin(0), lastBandLevels(0), numFullLast(0), lastPartialSize(0)
+    {}
+    TreeletLayout(const size_t numNodes, const int depth);
+
+    //! depth of the given node, the root has depth 0
+    static __forceinline int depthOf(const size_t nodeID)
+    { int d = 0; for (size_t n=nodeID+1;n>1;n>>=1) ++d; return d; }
+
+    //! where the node with heap index 'nodeID' is stored
+    __forceinline size_t storageIndex(const size_t nodeID) const
+    {
+      if (!depth) return nodeID;
+      const int d = depthOf(nodeID);
+      const int bandBegin = (d/depth)*depth;
+      const int localDepth = d-bandBegin;
+      const size_t bandStart = (size_t(1)<<bandBegin)-1;
+      const size_t localID = ((size_t(1)<<localDepth)-1)
+        + ((nodeID+1) & ((size_t(1)<<localDepth)-1));
+      const size_t treeletID = ((nodeID+1)>>localDepth)-1-bandStart;
+      if (bandBegin < lastBandBegin)
+        return bandStart + treeletID*((size_t(1)<<depth)-1) + localID;
+      const size_t fullSize    = (size_t(1)<<lastBandLevels)-1;
+      const size_t reducedSize = (size_t(1)<<(lastBandLevels-1))-1;
+      if (treeletID <= numFullLast)
+        return bandStart + treeletID*fullSize + localID;
+      return bandStart + numFullLast*fullSize + lastPartialSize
+        + (treeletID-numFullLast-1)*reducedSize + localID;
+    }
+
+    int    depth;
+    //! first level of the last band, and number of levels in it
+    int    lastBandBegin, lastBandLevels;
+    //! number of complete treelets in the last band
+    size_t numFullLast;
+    //! size of the partially filled treelet in the last band
+    size_t lastPartialSize;
+  };
+
   //! \brief particle-kd-tree class. 
   /*! \detailed Note that this class will actually re-order the
       particle model 'in place', so the order of the particles (and
@@ -32,13 +84,51 @@ namespace ospray {
     size_t numInnerNodes;
     size_t numLevels;
     int roundRobin;
+    /*! number of particles per leaf bucket, or 0 for the classic
+        layout of one particle per node */
+    size_t bucketSize;
+    /*! split plane of each inner node of a bucketed tree, with the
+        split dim in the lower two mantissa bits */
+    std::vector<float> splitPlane;
+    //! storage order of the nodes, see reorderTreelets()
+    TreeletLayout treelets;
 
     PartiKD(bool roundRobin=0) 
-      : model(NULL), numParticles(0), numInnerNodes(0), roundRobin(roundRobin)
+      : model(NULL), numParticles(0), numInnerNodes(0), roundRobin(roundRobin),
+        bucketSize(0)
     {};
 
     //! build particle tree over given model. WILL REORDER THE MODEL'S ELEMENTS
     void build(ParticleModel *model);
+
+    /*! refit a tree previously built over 'model' (which must carry
+        particle IDs) to the new particle data in 'current', which is
+        indexed by particle ID. Positions are updated in place, and
+        only subtrees whose kd-invariant broke get rebuilt. Returns
+        the fraction of nodes that had to be rebuilt */
+    float refit(ParticleModel *model, const ParticleModel &current);
+
+    /*! build a bucketed tree over given model: inner nodes are pure
+        split planes, and each leaf holds 'bucketSize' particles. The
+        model's elements get reordered into bucket order, with each
+        bucket padded up to 'bucketSize' by replicating its last
+        particle. WILL REORDER AND RESIZE THE MODEL'S ELEMENTS */
+    void buildBucketed(ParticleModel *model, size_t bucketSize);
+    //! particle positions of a bucketed tree, as x[],y[],z[] per bucket
+    std::vector<float> bucketPositionsSoA() const;
+    /*! particle positions of a classic tree quantized to 20 bits per
+        coordinate relative to 'bounds', with the split dim in the
+        lower two bits (see PKD_POSITION_QUANTIZED64). A quantized
+        coordinate i stands for the cell center lower+(i+.5)*scale,
+        with scale=(upper-lower)/2^20 */
+    std::vector<uint64> quantizedPositions(const box3f &bounds) const;
+
+    /*! move the model's elements of a built (classic) tree from heap
+        order into treelet order with treelets of 'depth' levels, see
+        TreeletLayout. Must be the last step before saving or
+        rendering the tree, as building and refitting expect heap
+        order. WILL REORDER THE MODEL'S ELEMENTS */
+    void reorderTreelets(int depth);
     
     //! save to xml+binary file
     void saveOSP(const std::string &fileName);
@@ -46,6 +136,11 @@ namespace ospray {
     //! save to xml+binary file(s)
     void saveOSP(FILE *xml, FILE *bin);
     void saveOSPQuantized(FILE *xml, FILE *bin);
+    /*! save to a single-file, memory-mappable pkd container (see
+        PKDFileHeader), with quantized or full float positions, and
+        float or compact (attributeBits 16 or 8) attributes */
+    void saveContainer(const std::string &fileName, bool quantized = false,
+                       int attributeBits = 32);
 
     /*! @{ \brief Balanced KD-tree helper functions */
     
@@ -65,11 +160,118 @@ namespace ospray {
 
     void buildRec(const size_t nodeID, const box3f &bounds, const size_t depth) const;
 
+    struct RebuildJob {
+      size_t nodeID;
+      box3f  bounds;
+      size_t depth;
+      RebuildJob(size_t nodeID, const box3f &bounds, size_t depth)
+        : nodeID(nodeID), bounds(bounds), depth(depth)
+      {}
+    };
+    /*! check the kd-invariant of the given subtree after a refit;
+        returns the bounds of the subtree's particle centers and
+        appends the topmost broken nodes to 'rebuild' */
+    box3f refitRec(const size_t nodeID, const box3f &bounds, const size_t depth,
+                   std::vector<RebuildJob> &rebuild) const;
+    //! number of nodes in the subtree rooted at nodeID
+    size_t subtreeSize(const size_t nodeID) const;
+    //! number of nodes in the subtree rooted at nodeID, for a tree of numNodes nodes
+    static size_t subtreeSize(const size_t nodeID, const size_t numNodes);
+
+    /*! partition the particles of the leaves [firstLeaf,..) below
+        nodeID of a bucketed tree, 'order' is the particle order being
+        built and bucketRange the resulting particles of each bucket */
+    void buildBucketedRec(const size_t nodeID, const size_t firstLeaf,
+                          const box3f &bounds, const size_t depth,
+                          uint32 *order,
+                          std::vector<std::pair<size_t,size_t>> &bucketRange);
+
     //! helper function for building - swap two particles in the model
     inline void swap(const size_t a, const size_t b) const;
 
     // save the given particle's split dimension
     void setDim(size_t ID, int dim) const;
+    // get the given particle's split dimension
+    int getDim(size_t ID) const;
+
+    //! set up the tree sizes for the given model
+    void init(ParticleModel *model);
+  };
+
+  /*! store each of 'value' normalized to [lo,hi] in 'bits' (8 or 16)
+      bits, as unsigned integers in native byte order. this is the
+      format pkd geometries take uchar/ushort 'attribute' data in */
+  std::vector<uint8> compactAttribute(const std::vector<float> &value,
+                                      const float lo, const float hi, const int bits);
+
+  /*! write the xml part of a pkd file for a tree of numParticles
+      particles that gets stored like PartiKD::saveOSP does: the
+      positions (vec3f) at offset 0 of the binary file, followed by one
+      float column per attribute, and the types (if any) as float */
+  void saveOSPHeader(const std::string &fileName, const size_t numParticles,
+                     const std::vector<std::string> &attributeName,
+                     const bool hasType, const float radius);
+
+  /*! \brief external-memory pkd builder, for particle sets larger than main memory
+
+    \detailed Builds a tree with the same shape and split rules as
+    a PartiKD over all particles, and writes it in the same format as
+    saveOSP, but keeps only about 'memoryBudget' bytes of particle
+    data in memory. Particles get streamed into a bucket file on disk with
+    addParticles(); build() then selects the split particle of each
+    node whose subtree doesn't fit the budget with streaming
+    histogram passes over the node's bucket, and splits the bucket
+    into one bucket file per child. Subtrees that do fit are built in
+    memory, and since each level of a subtree is contiguous in the
+    final heap order, written straight to their place in the output
+    file. */
+  struct OutOfCorePartiKD {
+    OutOfCorePartiKD(size_t memoryBudget, const std::string &tmpDir);
+    ~OutOfCorePartiKD();
+
+    /*! append the particles of 'model' to the particles to build
+        over. All models have to have the same attributes */
+    void addParticles(const ParticleModel &model);
+    //! build the tree and write it to 'fileName' (xml) and 'fileName'+"bin"
+    void build(const std::string &fileName, float radius);
+
+    //! name of a new bucket file in tmpDir
+    std::string newBucketFileName();
+    //! bytes per particle record in the bucket files
+    size_t recordBytes() const { return recordFloats()*sizeof(float); }
+    //! floats per particle record: position, attributes, and type (if present)
+    size_t recordFloats() const { return 3+attributeName.size()+(hasType?1:0); }
+    //! number of records to read or write at a time
+    size_t ioChunkSize() const;
+
+    /*! build the subtree of 'nodeID' from the particles in 'bucket',
+        deleting the bucket file once it's been consumed */
+    void buildRec(const std::string &bucket, const size_t nodeID,
+                  const box3f &bounds, const size_t depth);
+    //! build a subtree that fits the memory budget, and write it out
+    void buildInMemory(const std::string &bucket, const size_t nodeID,
+                       const box3f &bounds, const size_t depth);
+    /*! find the particle of rank 'k' along 'dim' in the given bucket:
+        its coordinate 'plane', and how many particles with that same
+        coordinate rank below it */
+    void selectSplit(const std::string &bucket, const size_t numInBucket,
+                     const int dim, const box3f &bounds, const size_t k,
+                     float &plane, size_t &numEqualBelow) const;
+    //! write 'count' records starting at the given node of the output
+    void writeNodes(const size_t nodeID, const float *record, const size_t count);
+
+    size_t      memoryBudget;
+    std::string tmpDir;
+    size_t      numParticles;
+    box3f       bounds;
+    std::vector<std::string> attributeName;
+    bool        hasType;
+    //! the bucket all particles get streamed into
+    std::string rootBucket;
+    FILE       *rootFile;
+    //! the output's binary file, while building
+    FILE       *bin;
+    size_t      numBucketFiles;
   };
 
 }
@@ -25,8 +25,15 @@ namespace ospray {
   {
     std::vector<std::string> input;
     std::string output, outputQuantized;
+    std::string container;
+    bool containerQuantized = false;
+    int attributeBits = 32;
     ParticleModel model;
     bool roundRobin = false;
+    size_t bucketSize = 0;
+    int treeletDepth = 0;
+    size_t memoryBudget = 0;
+    std::string tmpDir = ".";
 
     for (int i=1;i<ac;i++) {
       std::string arg = av[i];
@@ -39,8 +46,41 @@ namespace ospray {
           if (i+1 >= ac || av[i+1][0] == '-')
             throw std::runtime_error("no filename passed to '--quantize'");
           outputQuantized = av[++i];
+        } else if (arg == "--container" || arg == "--container-quantized") {
+          if (i+1 >= ac || av[i+1][0] == '-')
+            throw std::runtime_error("no filename passed to '"+arg+"'");
+          container = av[++i];
+          containerQuantized = arg == "--container-quantized";
+        } else if (arg == "--attribute-bits") {
+          if (i+1 >= ac)
+            throw std::runtime_error("no bits passed to '--attribute-bits'");
+          attributeBits = atoi(av[++i]);
+          if (attributeBits != 8 && attributeBits != 16 && attributeBits != 32)
+            throw std::runtime_error("invalid attribute bits, must be 8, 16 or 32");
         } else if (arg == "--round-robin") {
           roundRobin = true;
+        } else if (arg == "--bucket-size") {
+          if (i+1 >= ac)
+            throw std::runtime_error("no size passed to '--bucket-size'");
+          bucketSize = atol(av[++i]);
+          if (bucketSize == 0)
+            throw std::runtime_error("invalid bucket size");
+        } else if (arg == "--treelet-depth") {
+          if (i+1 >= ac)
+            throw std::runtime_error("no depth passed to '--treelet-depth'");
+          treeletDepth = atoi(av[++i]);
+          if (treeletDepth <= 0 || treeletDepth > 16)
+            throw std::runtime_error("invalid treelet depth");
+        } else if (arg == "--memory-budget") {
+          if (i+1 >= ac)
+            throw std::runtime_error("no budget passed to '--memory-budget'");
+          memoryBudget = size_t(atol(av[++i])) << 20;
+          if (memoryBudget == 0)
+            throw std::runtime_error("invalid memory budget");
+        } else if (arg == "--tmp-dir") {
+          if (i+1 >= ac)
+            throw std::runtime_error("no directory passed to '--tmp-dir'");
+          tmpDir = av[++i];
         } else {
           throw std::runtime_error("unknown parameter '"+arg+"'");
         }
@@ -51,12 +91,45 @@ namespace ospray {
     if (input.empty()) {
       throw std::runtime_error("no input file(s) specified");
     }
-    if (output == "")
+    if (output == "" && container == "")
       throw std::runtime_error("no output file specified");
+    if (attributeBits != 32 && container == "")
+      throw std::runtime_error("'--attribute-bits' only applies to '--container' output");
+    if (bucketSize && treeletDepth)
+      throw std::runtime_error("'--treelet-depth' can't be used with '--bucket-size'");
     
     if (model.radius == 0.f)
       std::cout << "#osp:pkd: no radius specified on command line" << std::endl;
 
+    if (memoryBudget) {
+      if (bucketSize || treeletDepth || outputQuantized != "")
+        throw std::runtime_error("out-of-core builds only support the classic layout");
+      if (output == "" || container != "")
+        throw std::runtime_error("out-of-core builds only write the xml+binary format");
+      // stream the inputs into the builder one at a time, so only the
+      // largest input has to fit in memory
+      double before = getSysTime();
+      OutOfCorePartiKD partiKD(memoryBudget,tmpDir);
+      for (int i=0;i<input.size();i++) {
+        cout << "#osp:pkd: loading " << input[i] << endl;
+        ParticleModel inputModel;
+        inputModel.radius = model.radius;
+        inputModel.load(input[i]);
+        model.radius = inputModel.radius;
+        partiKD.addParticles(inputModel);
+      }
+      if (model.radius == 0.f) {
+        throw std::runtime_error("no radius specified via either command line or model file");
+      }
+      std::cout << "#osp:pkd: building tree over " << partiKD.numParticles
+        << " particles out of core, writing to " << output << std::endl;
+      partiKD.build(output,model.radius);
+      double after = getSysTime();
+      std::cout << "#osp:pkd: tree built (" << (after-before) << " sec)" << std::endl;
+      std::cout << "#osp:pkd: done." << endl;
+      return;
+    }
+
     // load the input(s)
     for (int i=0;i<input.size();i++) {
       cout << "#osp:pkd: loading " << input[i] << endl;
@@ -70,16 +143,28 @@ namespace ospray {
     double before = getSysTime();
     std::cout << "#osp:pkd: building tree ..." << std::endl;
     PartiKD partiKD(roundRobin);
-    partiKD.build(&model);
+    if (bucketSize)
+      partiKD.buildBucketed(&model,bucketSize);
+    else
+      partiKD.build(&model);
+    if (treeletDepth)
+      partiKD.reorderTreelets(treeletDepth);
     double after = getSysTime();
     std::cout << "#osp:pkd: tree built (" << (after-before) << " sec)" << std::endl;
 
-    std::cout << "#osp:pkd: writing binary data to " << output << endl;
-    partiKD.saveOSP(output);
+    if (output != "") {
+      std::cout << "#osp:pkd: writing binary data to " << output << endl;
+      partiKD.saveOSP(output);
+    }
     if (outputQuantized != "") {
       std::cout << "#osp:pkd: writing QUANTIZED binary data to " << outputQuantized << endl;
       partiKD.saveOSPQuantized(outputQuantized);
     }
+    if (container != "") {
+      std::cout << "#osp:pkd: writing " << (containerQuantized ? "QUANTIZED " : "")
+        << "pkd container to " << container << endl;
+      partiKD.saveContainer(container,containerQuantized,attributeBits);
+    }
 
     std::cout << "#osp:pkd: done." << endl;
   }
@@ -92,7 +177,8 @@ int main(int ac, char **av)
   } catch (std::runtime_error(e)) {
     cout << "#osp:pkd (fatal): " << e.what() << endl;
     cout << "usage:" << endl;
-    cout << "./ospPartiKD <inputfile(s)> -o output.pkd [--round-robin] [--quantize quantized.pkd]\n" << endl;
+    cout << "./ospPartiKD <inputfile(s)> -o output.pkd [--round-robin] [--quantize quantized.pkd] [--bucket-size N] [--treelet-depth K]\n"
+      << "  [--container[-quantized] output.pkdc [--attribute-bits 8|16|32]] [--memory-budget MB [--tmp-dir DIR]]\n" << endl;
     
   }
 }
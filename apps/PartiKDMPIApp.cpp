@@ -0,0 +1,98 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "PartiKD.h"
+#include "libIS/splitKD.h"
+
+using std::endl;
+using std::cout;
+
+namespace ospray {
+
+  /*! distributed version of ospPartiKD: the input files get loaded
+      round-robin over the ranks, and all ranks build and write the
+      one tree over all of them together */
+  void partiKDMPIMain(int ac, char **av)
+  {
+    int rank, size;
+    MPI_CALL(Comm_rank(MPI_COMM_WORLD,&rank));
+    MPI_CALL(Comm_size(MPI_COMM_WORLD,&size));
+
+    std::vector<std::string> input;
+    std::string output;
+    ParticleModel model;
+
+    for (int i=1;i<ac;i++) {
+      std::string arg = av[i];
+      if (arg[0] == '-') {
+        if (arg == "-o") {
+          output = av[++i];
+        } else if (arg == "--radius") {
+          model.radius = atof(av[++i]);
+        } else {
+          throw std::runtime_error("unknown parameter '"+arg+"'");
+        }
+      } else {
+        input.push_back(arg);
+      }
+    }
+    if (input.empty()) {
+      throw std::runtime_error("no input file(s) specified");
+    }
+    if (output == "")
+      throw std::runtime_error("no output file specified");
+
+    // load our share of the input(s)
+    for (int i=rank;i<input.size();i+=size) {
+      cout << "#osp:pkd: rank " << rank << " loading " << input[i] << endl;
+      model.load(input[i]);
+    }
+    MPI_CALL(Allreduce(MPI_IN_PLACE,&model.radius,1,MPI_FLOAT,MPI_MAX,MPI_COMM_WORLD));
+    if (model.radius == 0.f) {
+      throw std::runtime_error("no radius specified via either command line or model file");
+    }
+
+    double before = getSysTime();
+    if (rank == 0)
+      std::cout << "#osp:pkd: building tree on " << size << " ranks ..." << std::endl;
+    DistributedPartiKD partiKD(MPI_COMM_WORLD);
+    partiKD.build(model);
+    MPI_CALL(Barrier(MPI_COMM_WORLD));
+    double after = getSysTime();
+    if (rank == 0) {
+      std::cout << "#osp:pkd: tree over " << partiKD.numParticles << " particles built ("
+        << (after-before) << " sec)" << std::endl;
+      std::cout << "#osp:pkd: writing binary data to " << output << endl;
+    }
+    partiKD.save(output,model.radius);
+    if (rank == 0)
+      std::cout << "#osp:pkd: done." << endl;
+  }
+}
+
+int main(int ac, char **av)
+{
+  MPI_Init(&ac,&av);
+  try {
+    ospray::partiKDMPIMain(ac,av);
+  } catch (std::runtime_error(e)) {
+    cout << "#osp:pkd (fatal): " << e.what() << endl;
+    cout << "usage:" << endl;
+    cout << "mpirun ./ospPartiKDMPI <inputfile(s)> -o output.pkd [--radius R]\n" << endl;
+    MPI_Abort(MPI_COMM_WORLD,1);
+  }
+  MPI_Finalize();
+}
@@ -63,6 +63,7 @@ namespace ospray {
 
     std::vector<vec_t> position;   //!< particle position
     std::vector<int>   type;       //!< 'type' of particle (e.g., the atom type for atomistic models)
+    std::vector<uint32> id;        //!< stable particle ID (optional; used for refitting pkd trees)
     std::vector<Attribute *> attribute;
 
     //! get attributeset of given name; create a new one if not yet exists */
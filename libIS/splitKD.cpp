@@ -1,55 +1,414 @@
-  float ghosting;
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
 
-  struct Split {
-    box3f domain;
-    box3f ghostDomain;
-    size_t totalSize;
-    std::vector<vec3f> particle;
-  };
+#include "splitKD.h"
+#include "apps/PartiKD.h"
 
-  Split *initialSplit(const std::vector<vec3f> &particle)
+namespace ospray {
+
+  /*! groups with fewer particles than this per rank don't get split
+      across ranks any further, but gathered on a single rank */
+  const size_t MIN_PARTICLES_PER_RANK = 1<<16;
+  /*! selecting a split gathers the candidate coordinates on all ranks
+      of the group once there are fewer than this many of them */
+  const size_t MAX_SPLIT_CANDIDATES = 1<<22;
+
+  DistributedPartiKD::DistributedPartiKD(MPI_Comm comm)
+    : comm(comm), numParticles(0), hasType(false), subtreeRoot(size_t(-1))
   {
-    Split *s = new Split;
-    s->domain = computeBounds(particle);
-    s->ghostDomain.min = s->domain.min - vec3f(
+    MPI_CALL(Comm_rank(comm,&rank));
+    MPI_CALL(Comm_size(comm,&size));
   }
 
-  void distributeParticles(std::vector<vec3f> &particle)
+  void DistributedPartiKD::build(ParticleModel &model)
   {
-    std::priority_queue<Split> splitQueue;
-
-    splitQueue.push(initialSplit(particle));
-    while (splitQueue.size() < size) {
-      Split thisSplit = splitQueue.top();
-      splitQueue.pop();
-
-      Split newSplit[2];
-      SplitOne(thisSplit,newSplit);
-      splitQueue.push(newSplit[0]);
-      splitQueue.push(newSplit[1]);
-    }
-
-    Split finalSplit[size];
-    std::copy(splitQueue.begin(),splitQueue.end(),finalSplit);
-    
-    std::vector<vec3f> oldParticle = particle;
-    for (int src=0;src<size;src++)
-      for (int tgt=0;tgt<size;tgt++) {
-        if (rank == src) {
-          int numToTgt = finalSplit[tgt].myEnd - finalSplit[tgt].myBegin;
-          MPI_CALL(Send(&numToTgt,1,MPI_INT,tgt,0,ownComm));
-          MPI_CALL(Send(&oldParticle[finalSplit[tgt].myBegin],numToTgt*3,MPI_FLOAT,
-                        tgt,0,ownComm));
-        }
-        if (rank == tgt) {
-          int numFromSrc = 0;
-          MPI_CALL(Recv(&numToTgt,1,MPI_INT,tgt,0,ownComm,MPI_STATUS_IGNORE));
-          MPI_CALL(Send(&particle[finalSplit[tgt].myBegin],numToTgt*3,MPI_FLOAT,
-                        tgt,0,ownComm,MPI_STATUS_IGNORE));
+    // agree on the layout of the particle records, as given by the
+    // first rank that has any particles
+    const int hasParticles = !model.position.empty();
+    int layoutRank = hasParticles ? rank : size;
+    MPI_CALL(Allreduce(MPI_IN_PLACE,&layoutRank,1,MPI_INT,MPI_MIN,comm));
+    if (layoutRank == size)
+      throw std::runtime_error("#osp:pkd: no particles to build over");
+
+    std::string layout;
+    if (rank == layoutRank) {
+      layout = model.type.empty() ? "0" : "1";
+      for (size_t i=0;i<model.attribute.size();i++)
+        layout += "\n" + model.attribute[i]->name;
+    }
+    int layoutSize = layout.size();
+    MPI_CALL(Bcast(&layoutSize,1,MPI_INT,layoutRank,comm));
+    layout.resize(layoutSize);
+    MPI_CALL(Bcast(&layout[0],layoutSize,MPI_CHAR,layoutRank,comm));
+    std::stringstream layoutStream(layout);
+    std::string line;
+    std::getline(layoutStream,line);
+    hasType = line == "1";
+    while (std::getline(layoutStream,line))
+      attributeName.push_back(line);
+
+    if (hasParticles) {
+      bool sameLayout = model.attribute.size() == attributeName.size()
+        && model.type.empty() != hasType;
+      for (size_t i=0;sameLayout && i<attributeName.size();i++)
+        sameLayout = model.attribute[i]->name == attributeName[i];
+      if (!sameLayout)
+        throw std::runtime_error("#osp:pkd: all ranks need the same attributes for distributed builds");
+    }
 
+    uint64_t localParticles = model.position.size();
+    uint64_t totalParticles = 0;
+    MPI_CALL(Allreduce(&localParticles,&totalParticles,1,MPI_UINT64_T,MPI_SUM,comm));
+    numParticles = totalParticles;
+
+    box3f bounds = model.getBounds();
+    MPI_CALL(Allreduce(MPI_IN_PLACE,&bounds.lower,3,MPI_FLOAT,MPI_MIN,comm));
+    MPI_CALL(Allreduce(MPI_IN_PLACE,&bounds.upper,3,MPI_FLOAT,MPI_MAX,comm));
+
+    // pack our particles into records, freeing the model as we go
+    const size_t stride = recordFloats();
+    std::vector<float> record(localParticles*stride);
+    for (size_t i=0;i<localParticles;i++) {
+      float *r = &record[i*stride];
+      const vec3f &p = model.position[i];
+      r[0] = p.x; r[1] = p.y; r[2] = p.z;
+      for (size_t a=0;a<attributeName.size();a++)
+        r[3+a] = model.attribute[a]->value[i];
+      if (hasType)
+        r[stride-1] = model.type[i];
+    }
+    std::vector<vec3f>().swap(model.position);
+    std::vector<int>().swap(model.type);
+    for (size_t a=0;a<model.attribute.size();a++)
+      std::vector<float>().swap(model.attribute[a]->value);
+
+    MPI_Comm group;
+    MPI_CALL(Comm_dup(comm,&group));
+    buildRec(group,record,0,bounds,0);
+    MPI_CALL(Comm_free(&group));
+  }
+
+  void DistributedPartiKD::selectSplit(MPI_Comm group, const std::vector<float> &record,
+                                       const size_t n, const int dim, const box3f &bounds,
+                                       const size_t k, float &plane, size_t &numEqualBelow) const
+  {
+    // narrow down the range of coordinates the particle of rank k is
+    // in with histograms over the whole group, until few enough
+    // particles are left in that range to gather them everywhere (or
+    // they all have the same coordinate)
+    static const int numBins = 1<<12;
+    struct BinLevel { float lo, hi; int bin; };
+    std::vector<BinLevel> path;
+    auto binOf = [](float v, float lo, float hi) {
+      return std::min(numBins-1,std::max(0,int(numBins*((v-lo)/(hi-lo)))));
+    };
+    auto inRange = [&](float v) {
+      for (size_t i=0;i<path.size();i++)
+        if (binOf(v,path[i].lo,path[i].hi) != path[i].bin) return false;
+      return true;
+    };
+
+    int groupSize;
+    MPI_CALL(Comm_size(group,&groupSize));
+    const size_t stride = recordFloats();
+    const size_t numLocal = record.size()/stride;
+    float lo = bounds.lower[dim], hi = bounds.upper[dim];
+    size_t numBelow = 0, numInRange = n;
+    while (1) {
+      if (lo == hi) {
+        plane = lo;
+        numEqualBelow = k-numBelow;
+        return;
+      }
+      if (numInRange <= MAX_SPLIT_CANDIDATES) {
+        std::vector<float> localValue;
+        for (size_t i=0;i<numLocal;i++)
+          if (inRange(record[i*stride+dim])) localValue.push_back(record[i*stride+dim]);
+        int numLocalValues = localValue.size();
+        std::vector<int> count(groupSize), ofs(groupSize,0);
+        MPI_CALL(Allgather(&numLocalValues,1,MPI_INT,&count[0],1,MPI_INT,group));
+        for (int r=1;r<groupSize;r++)
+          ofs[r] = ofs[r-1]+count[r-1];
+        std::vector<float> value(numInRange);
+        MPI_CALL(Allgatherv(localValue.data(),numLocalValues,MPI_FLOAT,
+                            &value[0],&count[0],&ofs[0],MPI_FLOAT,group));
+        std::nth_element(value.begin(),value.begin()+(k-numBelow),value.end());
+        plane = value[k-numBelow];
+        size_t numLess = 0;
+        for (size_t i=0;i<value.size();i++)
+          if (value[i] < plane) ++numLess;
+        numEqualBelow = k-numBelow-numLess;
+        return;
+      }
+
+      std::vector<uint64_t> count(numBins,0);
+      std::vector<float> binLo(numBins,+std::numeric_limits<float>::infinity());
+      std::vector<float> binHi(numBins,-std::numeric_limits<float>::infinity());
+      for (size_t i=0;i<numLocal;i++) {
+        const float v = record[i*stride+dim];
+        if (!inRange(v)) continue;
+        const int b = binOf(v,lo,hi);
+        ++count[b];
+        binLo[b] = std::min(binLo[b],v);
+        binHi[b] = std::max(binHi[b],v);
+      }
+      MPI_CALL(Allreduce(MPI_IN_PLACE,&count[0],numBins,MPI_UINT64_T,MPI_SUM,group));
+      MPI_CALL(Allreduce(MPI_IN_PLACE,&binLo[0],numBins,MPI_FLOAT,MPI_MIN,group));
+      MPI_CALL(Allreduce(MPI_IN_PLACE,&binHi[0],numBins,MPI_FLOAT,MPI_MAX,group));
+      int b = 0;
+      while (numBelow+count[b] <= k) numBelow += count[b++];
+      path.push_back({lo,hi,b});
+      numInRange = count[b];
+      lo = binLo[b];
+      hi = binHi[b];
+    }
+  }
+
+  void DistributedPartiKD::buildRec(MPI_Comm group, std::vector<float> &record,
+                                    const size_t nodeID, const box3f &bounds,
+                                    const size_t depth)
+  {
+    int groupRank, groupSize;
+    MPI_CALL(Comm_rank(group,&groupRank));
+    MPI_CALL(Comm_size(group,&groupSize));
+    const size_t stride = recordFloats();
+    const size_t n = PartiKD::subtreeSize(nodeID,numParticles);
+
+    MPI_Datatype recordType;
+    MPI_CALL(Type_contiguous(stride,MPI_FLOAT,&recordType));
+    MPI_CALL(Type_commit(&recordType));
+
+    if (groupSize == 1) {
+      MPI_CALL(Type_free(&recordType));
+      buildLocal(record,nodeID,bounds,depth);
+      return;
+    }
+    if (n < groupSize*MIN_PARTICLES_PER_RANK) {
+      // not worth splitting any further, the group's first rank builds it
+      int numLocal = record.size()/stride;
+      std::vector<int> count(groupSize), ofs(groupSize,0);
+      MPI_CALL(Gather(&numLocal,1,MPI_INT,&count[0],1,MPI_INT,0,group));
+      std::vector<float> gathered;
+      if (groupRank == 0) {
+        for (int r=1;r<groupSize;r++)
+          ofs[r] = ofs[r-1]+count[r-1];
+        gathered.resize(n*stride);
+      }
+      MPI_CALL(Gatherv(record.data(),numLocal,recordType,
+                       gathered.data(),&count[0],&ofs[0],recordType,0,group));
+      MPI_CALL(Type_free(&recordType));
+      std::vector<float>().swap(record);
+      if (groupRank == 0)
+        buildLocal(gathered,nodeID,bounds,depth);
+      return;
+    }
+
+#if DIM_ROUND_ROBIN
+    const size_t dim = depth % 3;
+#else
+    const size_t dim = maxDim(bounds.size());
+#endif
+    const size_t lChild = PartiKD::leftChildOf(nodeID);
+    const size_t rChild = PartiKD::rightChildOf(nodeID);
+    const size_t numLeft = PartiKD::subtreeSize(lChild,numParticles);
+    const size_t numRight = n-1-numLeft;
+
+    float plane;
+    size_t numEqualLeft;
+    selectSplit(group,record,n,dim,bounds,numLeft,plane,numEqualLeft);
+
+    // the particles with the same coordinate as the split plane are
+    // ordered by rank, then by their local order
+    const size_t numLocal = record.size()/stride;
+    uint64_t localEqual = 0, firstEqual = 0;
+    for (size_t i=0;i<numLocal;i++)
+      if (record[i*stride+dim] == plane) ++localEqual;
+    MPI_CALL(Exscan(&localEqual,&firstEqual,1,MPI_UINT64_T,MPI_SUM,group));
+    if (groupRank == 0) firstEqual = 0;
+
+    // the particle of rank numLeft becomes this node, the ones below
+    // it go left, the others right
+    std::vector<float> left, right;
+    size_t equal = firstEqual;
+    for (size_t i=0;i<numLocal;i++) {
+      const float *r = &record[i*stride];
+      const float v = r[dim];
+      if (v < plane || (v == plane && equal < numEqualLeft))
+        left.insert(left.end(),r,r+stride);
+      else if (v == plane && equal == numEqualLeft) {
+        // store the split dim in the lower bits of x, like PartiKD::setDim
+        std::vector<float> root(r,r+stride);
+        int &xAsInt = (int &)root[0];
+        xAsInt = (xAsInt & ~3) | int(dim);
+        topNode.push_back(std::make_pair(nodeID,root));
+      } else
+        right.insert(right.end(),r,r+stride);
+      if (v == plane) ++equal;
+    }
+    std::vector<float>().swap(record);
+
+    // the child bounds get split at the coordinate the node actually
+    // stores, which has the dim bits in it for splits along x
+    float storedPlane = plane;
+    if (dim == 0)
+      (int &)storedPlane &= ~3;
+    box3f lBounds = bounds;
+    box3f rBounds = bounds;
+    lBounds.upper[dim] = rBounds.lower[dim] = storedPlane;
+
+    // the left subtree goes to the first 'mid' ranks of the group, the
+    // right one to the others, each spread evenly over its ranks
+    const int mid = std::min(groupSize-1,std::max(1,int(std::lround(double(groupSize)*numLeft/n))));
+    uint64_t localSplit[2] = { left.size()/stride, right.size()/stride };
+    uint64_t firstSplit[2] = { 0, 0 };
+    MPI_CALL(Exscan(localSplit,firstSplit,2,MPI_UINT64_T,MPI_SUM,group));
+    if (groupRank == 0) firstSplit[0] = firstSplit[1] = 0;
+
+    std::vector<int> sendCount(groupSize,0), sendOfs(groupSize,0);
+    for (uint64_t i=0;i<localSplit[0];i++)
+      ++sendCount[((firstSplit[0]+i)*mid)/numLeft];
+    for (uint64_t i=0;i<localSplit[1];i++)
+      ++sendCount[mid+((firstSplit[1]+i)*(groupSize-mid))/numRight];
+    std::vector<int> recvCount(groupSize), recvOfs(groupSize,0);
+    MPI_CALL(Alltoall(&sendCount[0],1,MPI_INT,&recvCount[0],1,MPI_INT,group));
+    for (int r=1;r<groupSize;r++) {
+      sendOfs[r] = sendOfs[r-1]+sendCount[r-1];
+      recvOfs[r] = recvOfs[r-1]+recvCount[r-1];
+    }
+    // the records to send are already sorted by target rank
+    std::vector<float> send;
+    send.reserve(left.size()+right.size());
+    send.insert(send.end(),left.begin(),left.end());
+    std::vector<float>().swap(left);
+    send.insert(send.end(),right.begin(),right.end());
+    std::vector<float>().swap(right);
+    std::vector<float> recv(size_t(recvOfs[groupSize-1]+recvCount[groupSize-1])*stride);
+    MPI_CALL(Alltoallv(send.data(),&sendCount[0],&sendOfs[0],recordType,
+                       recv.data(),&recvCount[0],&recvOfs[0],recordType,group));
+    MPI_CALL(Type_free(&recordType));
+    std::vector<float>().swap(send);
+
+    const bool goLeft = groupRank < mid;
+    MPI_Comm childGroup;
+    MPI_CALL(Comm_split(group,goLeft?0:1,groupRank,&childGroup));
+    if (goLeft)
+      buildRec(childGroup,recv,lChild,lBounds,depth+1);
+    else
+      buildRec(childGroup,recv,rChild,rBounds,depth+1);
+    MPI_CALL(Comm_free(&childGroup));
+  }
+
+  void DistributedPartiKD::buildLocal(std::vector<float> &record, const size_t nodeID,
+                                      const box3f &bounds, const size_t depth)
+  {
+    const size_t stride = recordFloats();
+    const size_t n = record.size()/stride;
+    if (n != PartiKD::subtreeSize(nodeID,numParticles))
+      throw std::runtime_error("#osp:pkd: particle count doesn't match the subtree to build");
+
+    subtreeRoot = nodeID;
+    subtree.position.resize(n);
+    for (size_t a=0;a<attributeName.size();a++)
+      subtree.getAttribute(attributeName[a])->value.resize(n);
+    if (hasType)
+      subtree.type.resize(n);
+    for (size_t i=0;i<n;i++) {
+      const float *r = &record[i*stride];
+      subtree.position[i] = vec3f(r[0],r[1],r[2]);
+      for (size_t a=0;a<attributeName.size();a++)
+        subtree.attribute[a]->value[i] = r[3+a];
+      if (hasType)
+        subtree.type[i] = int(r[stride-1]);
+    }
+    std::vector<float>().swap(record);
+
+    // the subtree of nodeID has the same shape as a tree over its n
+    // particles, so build that one (with the global depth, for the
+    // split dims)
+    PartiKD pkd;
+    pkd.init(&subtree);
+    pkd.buildRec(0,bounds,depth);
+  }
+
+  void DistributedPartiKD::writeColumn(MPI_File file, const size_t columnOfs, const int column)
+  {
+    // the runs of consecutive nodes this rank owns: single top nodes,
+    // and each level of its subtree
+    struct Run {
+      size_t nodeID, count;
+      const float *topNode;
+      size_t first;
+      bool operator<(const Run &other) const { return nodeID < other.nodeID; }
+    };
+    std::vector<Run> runs;
+    for (size_t i=0;i<topNode.size();i++)
+      runs.push_back({topNode[i].first,1,&topNode[i].second[0],0});
+    const size_t n = subtree.position.size();
+    for (size_t first=0,numInLevel=1,level=0;first<n;
+         first=PartiKD::leftChildOf(first),numInLevel*=2,++level)
+      runs.push_back({((subtreeRoot+1)<<level)-1,std::min(numInLevel,n-first),NULL,first});
+    std::sort(runs.begin(),runs.end());
+
+    const int elemFloats = column == 0 ? 3 : 1;
+    size_t numOwned = 0;
+    for (size_t i=0;i<runs.size();i++)
+      numOwned += runs[i].count;
+    std::vector<float> buffer(numOwned*elemFloats);
+    std::vector<int> blockLength(runs.size());
+    std::vector<MPI_Aint> blockOfs(runs.size());
+    float *out = buffer.data();
+    for (size_t i=0;i<runs.size();i++) {
+      const Run &run = runs[i];
+      blockLength[i] = run.count;
+      blockOfs[i] = run.nodeID*elemFloats*sizeof(float);
+      for (size_t j=0;j<run.count;j++) {
+        if (run.topNode) {
+          const float *r = run.topNode + (column == 0 ? 0 : 2+column);
+          std::copy(r,r+elemFloats,out);
+        } else if (column == 0) {
+          const vec3f &p = subtree.position[run.first+j];
+          out[0] = p.x; out[1] = p.y; out[2] = p.z;
+        } else if (column <= int(attributeName.size())) {
+          out[0] = subtree.attribute[column-1]->value[run.first+j];
+        } else {
+          out[0] = subtree.type[run.first+j];
         }
+        out += elemFloats;
       }
-    // now, exchange the respective parts ...
+    }
+
+    MPI_Datatype elemType, fileType;
+    MPI_CALL(Type_contiguous(elemFloats,MPI_FLOAT,&elemType));
+    MPI_CALL(Type_commit(&elemType));
+    MPI_CALL(Type_create_hindexed(runs.size(),blockLength.data(),blockOfs.data(),
+                                  elemType,&fileType));
+    MPI_CALL(Type_commit(&fileType));
+    MPI_CALL(File_set_view(file,columnOfs,elemType,fileType,(char*)"native",MPI_INFO_NULL));
+    MPI_CALL(File_write_all(file,buffer.data(),numOwned,elemType,MPI_STATUS_IGNORE));
+    MPI_CALL(Type_free(&fileType));
+    MPI_CALL(Type_free(&elemType));
   }
 
+  void DistributedPartiKD::save(const std::string &fileName, float radius)
+  {
+    // same layout as PartiKD::saveOSP: all positions, then one column
+    // per attribute, then the types
+    const std::string binFileName = fileName + "bin";
+    MPI_File file;
+    MPI_CALL(File_open(comm,(char*)binFileName.c_str(),MPI_MODE_CREATE|MPI_MODE_WRONLY,
+                       MPI_INFO_NULL,&file));
+    writeColumn(file,0,0);
+    size_t columnOfs = numParticles*sizeof(vec3f);
+    const int numColumns = 1+attributeName.size()+(hasType?1:0);
+    for (int c=1;c<numColumns;c++,columnOfs+=numParticles*sizeof(float))
+      writeColumn(file,columnOfs,c);
+    MPI_CALL(File_close(&file));
+
+    if (rank == 0)
+      saveOSPHeader(fileName,numParticles,attributeName,hasType,radius);
+  }
 
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <mpi.h>
+#include <string>
+#include <vector>
+
+#include "ospray/mpi/MPICommon.h"
+#include "apps/ParticleModel.h"
+
+namespace ospray {
+
+  /*! \brief distributed pkd builder, for building one big pkd over
+    the particles of all ranks of a communicator
+
+    \detailed The top of the tree is split across the ranks: for each
+    node the group of ranks owning its particles selects the split
+    particle of the right rank with histogram passes (allreduced over
+    the group), then the particles get exchanged so the left and right
+    subtrees go to two sub-groups of ranks, sized by the subtrees. Once
+    a group is down to a single rank, that rank builds the remaining
+    subtree with the (threaded) PartiKD builder. The resulting tree has
+    the same shape as a PartiKD over all particles, and save() writes it
+    in the same format as PartiKD::saveOSP with collective MPI-IO. */
+  struct DistributedPartiKD {
+    DistributedPartiKD(MPI_Comm comm);
+
+    /*! build the tree over the particles of all ranks; 'model' holds
+        this rank's particles (all ranks need the same attributes) and
+        gets consumed by the build */
+    void build(ParticleModel &model);
+    /*! write the tree to 'fileName' (xml, written by rank 0) and
+        'fileName'+"bin" (written collectively) */
+    void save(const std::string &fileName, float radius);
+
+    //! floats per particle record: position, attributes, and type (if present)
+    size_t recordFloats() const { return 3+attributeName.size()+(hasType?1:0); }
+
+    /*! build the subtree of 'nodeID', whose particles are spread
+        over the ranks of 'group' */
+    void buildRec(MPI_Comm group, std::vector<float> &record, const size_t nodeID,
+                  const box3f &bounds, const size_t depth);
+    //! build a subtree this rank holds all particles of
+    void buildLocal(std::vector<float> &record, const size_t nodeID,
+                    const box3f &bounds, const size_t depth);
+    /*! find the particle of rank 'k' along 'dim' over the group: its
+        coordinate 'plane', and how many particles with that same
+        coordinate rank below it */
+    void selectSplit(MPI_Comm group, const std::vector<float> &record,
+                     const size_t n, const int dim, const box3f &bounds,
+                     const size_t k, float &plane, size_t &numEqualBelow) const;
+    //! write one column of the output file, for all nodes this rank owns
+    void writeColumn(MPI_File file, const size_t columnOfs, const int column);
+
+    MPI_Comm    comm;
+    int         rank, size;
+    size_t      numParticles;
+    std::vector<std::string> attributeName;
+    bool        hasType;
+
+    //! top nodes this rank selected as split particle, and their records
+    std::vector<std::pair<size_t,std::vector<float>>> topNode;
+    //! root of the subtree this rank built, and the subtree in heap order
+    size_t      subtreeRoot;
+    ParticleModel subtree;
+  };
+
+}
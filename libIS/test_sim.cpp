@@ -1,5 +1,6 @@
 #include "is_sim.h"
 #include <unistd.h>
+#include <cstdlib>
 #include <vector>
 
 struct vec4f {
@@ -9,18 +10,38 @@ struct vec4f {
 int rank, size;
 std::vector<vec4f> particle;
 const float speed = .01f;
-const int NUM_PARTICLES = 20000;
+// particles per rank, can be overridden with the first command line argument
+size_t NUM_PARTICLES = 20000;
+// if > 0 (the second command line argument), each rank's particles are
+// spread over this many small clusters instead of uniformly over its slab
+int NUM_CLUSTERS = 0;
+const float clusterSize = .05f;
 
 void doTimeStep()
 {
   static int timeStep = 0;
 
   if (timeStep == 0) {
-    for (int i=0;i<NUM_PARTICLES;i++) {
+    std::vector<vec4f> cluster;
+    for (int i=0;i<NUM_CLUSTERS;i++) {
+      vec4f c;
+      c.x = (rank+drand48())/size;
+      c.y = drand48();
+      c.z = drand48();
+      cluster.push_back(c);
+    }
+    for (size_t i=0;i<NUM_PARTICLES;i++) {
       vec4f v;
-      v.x = (rank+drand48())/size;
-      v.y = drand48();
-      v.z = drand48();
+      if (cluster.empty()) {
+        v.x = (rank+drand48())/size;
+        v.y = drand48();
+        v.z = drand48();
+      } else {
+        const vec4f &c = cluster[i % cluster.size()];
+        v.x = c.x + clusterSize*(drand48()-.5f);
+        v.y = c.y + clusterSize*(drand48()-.5f);
+        v.z = c.z + clusterSize*(drand48()-.5f);
+      }
       v.attrib = drand48();
       particle.push_back(v);
     }
@@ -44,6 +65,12 @@ int main(int ac, char **av)
   MPI_CALL(Comm_rank(MPI_COMM_WORLD,&rank));
   MPI_CALL(Comm_size(MPI_COMM_WORLD,&size));
   ospIsInit(MPI_COMM_WORLD);
+  if (ac > 1) {
+    NUM_PARTICLES = atol(av[1]);
+  }
+  if (ac > 2) {
+    NUM_CLUSTERS = atoi(av[2]);
+  }
 
   while (1) {
     doTimeStep();
@@ -1,21 +1,33 @@
+#include <algorithm>
+#include <thread>
 #include "ospray/common/Core.h"
+#include "ospray/mpi/MPICommon.h"
+#include "ospray/camera/PerspectiveCamera.h"
 #include "common/tasking/parallel_for.h"
 
 #include "ISPDPRenderTask.h"
+#include "../testing_defines.h"
 // ispc exports
 #include "ISPRenderer_ispc.h"
 
 namespace ospray {
   ISPDPRenderTask::ISPDPRenderTask(Ref<Renderer> renderer, Ref<FrameBuffer> fb,
       size_t numTiles_x, size_t numTiles_y, uint32 channelFlags,
-      InSituSpheres *isSpheres)
+      InSituSpheres *isSpheres, bool skipEmptyTiles, bool compressTiles)
     : renderer(renderer), fb(fb), numTiles_x(numTiles_x), numTiles_y(numTiles_y),
-    channelFlags(channelFlags), isSpheres(isSpheres)
+    channelFlags(channelFlags), isSpheres(isSpheres),
+    skipEmptyTiles(skipEmptyTiles || compressTiles), compressTiles(compressTiles)
   {
+    if (this->skipEmptyTiles) {
+      heldTiles.resize(numTiles_x * numTiles_y);
+      heldBgTiles.resize(numTiles_x * numTiles_y);
+    }
     int nextBlockID = 0;
     for (auto &b : isSpheres->ddSpheres) {
       ISPCDDSpheresBlock ispcBlock;
       ispcBlock.actualDomain = b.actualDomain;
+      ispcBlock.tightBounds = b.tightBounds;
+      ispcBlock.occupancy = b.occupancy;
       ispcBlock.firstOwner = b.firstOwner;
       ispcBlock.numOwners = b.numOwners;
       ispcBlock.isMine = b.isMine;
@@ -29,6 +41,83 @@ namespace ospray {
       }
       pkdBlocks.push_back(ispcBlock);
     }
+    projectBlockTiles();
+  }
+
+  /*! project the corners of 'b' to pixel coordinates the way the
+      perspective camera generates its rays, see PerspectiveCamera.
+      returns false if 'b' reaches behind the camera */
+  static bool projectBox(const box3f &b, const vec3f &pos, const vec3f &dir,
+                         const vec3f &du, const vec3f &dv, const vec2f &imageSize,
+                         const vec2f &imageStart, const vec2f &imageEnd,
+                         const vec2i &fbSize, vec2f &lower, vec2f &upper)
+  {
+    lower = vec2f(std::numeric_limits<float>::infinity());
+    upper = vec2f(-std::numeric_limits<float>::infinity());
+    for (int i = 0; i < 8; i++) {
+      const vec3f corner((i & 1) ? b.upper.x : b.lower.x,
+                         (i & 2) ? b.upper.y : b.lower.y,
+                         (i & 4) ? b.upper.z : b.lower.z);
+      const vec3f v = corner - pos;
+      const float z = dot(v,dir);
+      if (z <= 1e-6f)
+        return false;
+      vec2f screen(dot(v,du)/(z*imageSize.x)+.5f, dot(v,dv)/(z*imageSize.y)+.5f);
+      screen = (screen - imageStart)/(imageEnd - imageStart);
+      const vec2f pixel(screen.x*fbSize.x, screen.y*fbSize.y);
+      lower = min(lower,pixel);
+      upper = max(upper,pixel);
+    }
+    return true;
+  }
+
+  void ISPDPRenderTask::projectBlockTiles() {
+    const TileRange allTiles = {vec2i(0), vec2i(numTiles_x-1,numTiles_y-1)};
+    blockTiles.assign(pkdBlocks.size(),allTiles);
+    blockDistance.assign(pkdBlocks.size(),0.f);
+
+    // only pinhole perspective cameras project to a simple rectangle,
+    // anything else may see any block from any tile
+    PerspectiveCamera *camera = dynamic_cast<PerspectiveCamera*>(renderer->camera.ptr);
+    if (!camera || camera->getParamf("apertureRadius",0.f) > 0.f
+        || camera->getParam1i("architectural",0) || camera->getParam1i("stereoMode",0))
+      return;
+
+    // same image plane as PerspectiveCamera::commit
+    const vec3f pos = camera->getParam3f("pos",vec3f(0.f));
+    const vec3f dir = normalize(camera->getParam3f("dir",vec3f(0.f,0.f,1.f)));
+    const vec3f up  = camera->getParam3f("up",vec3f(0.f,1.f,0.f));
+    const vec3f du  = normalize(cross(dir,up));
+    const vec3f dv  = cross(du,dir);
+    const float fovy   = camera->getParamf("fovy",60.f);
+    const float aspect = camera->getParamf("aspect",1.f);
+    const float imageHeight = 2.f*tanf(fovy/2.f*float(M_PI)/180.f);
+    const vec2f imageSize(imageHeight*aspect,imageHeight);
+    const vec2f imageStart = camera->getParam2f("imageStart",vec2f(0.f));
+    const vec2f imageEnd   = camera->getParam2f("imageEnd",vec2f(1.f));
+    if (imageEnd.x <= imageStart.x || imageEnd.y <= imageStart.y)
+      return;
+
+    for (size_t blockID = 0; blockID < pkdBlocks.size(); blockID++) {
+      // blocks without particles can't be seen by any tile
+      const box3f &bounds = pkdBlocks[blockID].tightBounds;
+      if (bounds.lower.x > bounds.upper.x) {
+        blockTiles[blockID].lower = vec2i(0);
+        blockTiles[blockID].upper = vec2i(-1);
+        continue;
+      }
+      blockDistance[blockID] = length(pos - max(bounds.lower,min(pos,bounds.upper)));
+      vec2f lower, upper;
+      if (!projectBox(bounds,pos,dir,du,dv,imageSize,
+                      imageStart,imageEnd,fb->size,lower,upper))
+        continue;
+      // a pixel of margin for the sample jitter and rounding
+      TileRange &range = blockTiles[blockID];
+      range.lower.x = std::max(int(floorf((lower.x-1.f)/TILE_SIZE)),0);
+      range.lower.y = std::max(int(floorf((lower.y-1.f)/TILE_SIZE)),0);
+      range.upper.x = std::min(int(floorf((upper.x+1.f)/TILE_SIZE)),int(numTiles_x)-1);
+      range.upper.y = std::min(int(floorf((upper.y+1.f)/TILE_SIZE)),int(numTiles_y)-1);
+    }
   }
 
   // This is basically a straight copy from the data-distributed DVR
@@ -41,7 +130,6 @@ namespace ospray {
     Tile bgTile(tileId, fb->size, accumID);
 
     const size_t numBlocks = isSpheres->ddSpheres.size();
-    ISPCacheForTiles blockTileCache(numBlocks);
     bool *blockWasVisible = STACK_BUFFER(bool, numBlocks);
 
     for (size_t i = 0; i < numBlocks; i++) {
@@ -50,6 +138,40 @@ namespace ospray {
 
     const bool myTile =
       (taskID % core::getWorkerCount()) == core::getWorkerRank();
+    const int myRank = ospray::core::getWorkerRank();
+
+    // the blocks this tile has to look at: all it may see if we own it
+    // (to count the tiles to expect for it), otherwise just the ones
+    // we render for it
+    int32 *tileBlocks = STACK_BUFFER(int32, numBlocks);
+    int32 *renderedBlocks = STACK_BUFFER(int32, numBlocks);
+    int numTileBlocks = 0;
+    int numRendered = 0;
+    for (size_t blockID = 0; blockID < numBlocks; blockID++) {
+      const TileRange &range = blockTiles[blockID];
+      if (int(tile_x) < range.lower.x || int(tile_x) > range.upper.x
+          || int(tile_y) < range.lower.y || int(tile_y) > range.upper.y)
+        continue;
+      const ISPCDDSpheresBlock &block = pkdBlocks[blockID];
+      const bool rendersBlock = block.isMine && block.cpp_pkd
+        && (myRank - block.firstOwner) == int(tileID % block.numOwners);
+      if (myTile || rendersBlock)
+        tileBlocks[numTileBlocks++] = blockID;
+      if (rendersBlock)
+        renderedBlocks[numRendered++] = blockID;
+    }
+    if (!myTile && numTileBlocks == 0)
+      return;
+    // nearest blocks first, so the rays can stop at the first hit
+    std::stable_sort(tileBlocks, tileBlocks + numTileBlocks, [&](int32 a, int32 b) {
+      return blockDistance[a] < blockDistance[b];
+    });
+
+    // all blocks we render for this tile go into a single block tile,
+    // which we keep under the first one's ID
+    const int32 localTileBlock = numRendered > 0 ? renderedBlocks[0] : -1;
+    numRendered = std::min(numRendered, 1);
+    ISPCacheForTiles blockTileCache(numBlocks, renderedBlocks, numRendered);
 
     const int numJobs = (TILE_SIZE*TILE_SIZE)/RENDERTILE_PIXELS_PER_JOB;
 
@@ -57,32 +179,62 @@ namespace ospray {
         ispc::ISPRendererDataDistrib_renderTile(renderer->getIE(),
             (ispc::Tile&)bgTile,
             &blockTileCache,
-            numBlocks,
+            numTileBlocks,
+            tileBlocks,
             const_cast<ISPCDDSpheresBlock*>(pkdBlocks.data()),
             blockWasVisible,
+            localTileBlock,
             tileID,
-            ospray::core::getWorkerRank(),
+            myRank,
             myTile,
             tid);
         });
 
+    if (skipEmptyTiles) {
+      // keep the block tiles a ray actually hit something in, the
+      // counts get agreed on in sendHeldTiles
+      for (int i = 0; i < numRendered; i++) {
+        Tile *tile = blockTileCache.renderedTile(renderedBlocks[i]);
+        if (tile == nullptr || !ispc::ISPRenderer_tileHasCoverage((ispc::Tile&)*tile))
+          continue;
+        Tile *held = new Tile(*tile);
+        held->region = bgTile.region;
+        held->fbSize = bgTile.fbSize;
+        held->rcp_fbSize = bgTile.rcp_fbSize;
+        held->accumID = accumID;
+        held->generation = 1;
+        held->children   = 0;
+        heldTiles[tileID].emplace_back(held);
+      }
+      if (myTile) {
+        bgTile.generation = 0;
+        heldBgTiles[tileID].reset(new Tile(bgTile));
+      }
+      return;
+    }
+
     if (myTile) {
       // this is a tile owned by me - i'm responsible for writing
       // generaition #0, and telling the fb how many more tiles will
       // be coming in generation #1
 
-      size_t totalBlocksInTile = 0;
+      // each rank sends one tile for all the visible blocks it renders
+      // for this tile, see ISPRendererDataDistrib_renderTile
+      int32 *renderRanks = STACK_BUFFER(int32, numBlocks);
+      size_t numRenderRanks = 0;
       for (size_t blockID = 0; blockID < numBlocks; blockID++) {
         if (blockWasVisible[blockID]) {
-          totalBlocksInTile++;
+          const ISPCDDSpheresBlock &block = pkdBlocks[blockID];
+          renderRanks[numRenderRanks++] = block.firstOwner + tileID % block.numOwners;
         }
       }
+      std::sort(renderRanks, renderRanks + numRenderRanks);
 
       /* I expect one additional tile for background tile.
-       * plus how many blocks map to this tile, IN TOTAL,
-       * INCLUDING blocks on other nodes
+       * plus how many ranks render blocks for this tile, IN TOTAL,
+       * INCLUDING other nodes
        */
-      size_t nextGenTiles = totalBlocksInTile;
+      size_t nextGenTiles = std::unique(renderRanks, renderRanks + numRenderRanks) - renderRanks;
 
       // set background tile
       bgTile.generation = 0;
@@ -102,8 +254,8 @@ namespace ospray {
     // _across_all_clients_, but we only have to send ours (assuming
     // that all clients together send exactly as many as the owner
     // told the DFB to expect)
-    for (size_t blockID = 0; blockID < numBlocks; blockID++) {
-      Tile *tile = blockTileCache.blockTiles[blockID];
+    for (int i = 0; i < numRendered; i++) {
+      Tile *tile = blockTileCache.renderedTile(renderedBlocks[i]);
       if (tile == nullptr)
         continue;
 
@@ -118,39 +270,189 @@ namespace ospray {
     }
   }
 
-  ISPCacheForTiles::ISPCacheForTiles(size_t numBlocks)
-    : blockTiles(numBlocks, nullptr)
-  {}
-  ISPCacheForTiles::~ISPCacheForTiles() {
-    for (auto &t : blockTiles) {
-      if (t != nullptr) {
-        delete t;
+  void ISPDPRenderTask::sendHeldTiles(MPI_Comm comm) {
+    const size_t numTiles = heldTiles.size();
+    std::vector<int32> numNonEmpty(numTiles);
+    for (size_t i = 0; i < numTiles; i++) {
+      numNonEmpty[i] = heldTiles[i].size();
+    }
+    MPI_CALL(Allreduce(MPI_IN_PLACE, numNonEmpty.data(), numTiles, MPI_INT, MPI_SUM, comm));
+    if (compressTiles) {
+      sendCompressedTiles(comm, numNonEmpty);
+      return;
+    }
+
+    parallel_for(numTiles, [&](int tileID){
+      // the background tile, plus the non-empty block tiles of all
+      // ranks, see operator()
+      if (heldBgTiles[tileID]) {
+        heldBgTiles[tileID]->children = numNonEmpty[tileID];
+        fb->setTile(*heldBgTiles[tileID]);
+      }
+      for (auto &tile : heldTiles[tileID]) {
+        fb->setTile(*tile);
+      }
+      heldBgTiles[tileID].reset();
+      heldTiles[tileID].clear();
+    });
+  }
+
+  void ISPDPRenderTask::sendCompressedTiles(MPI_Comm comm,
+      const std::vector<int32> &numNonEmpty) {
+    const int tag = 7;
+    const int numWorkers = core::getWorkerCount();
+    const size_t numTiles = heldTiles.size();
+
+    // encode the tiles of the tiles other ranks own, and count the ones
+    // we'll get for ours
+    std::vector<std::pair<int32, Tile*>> remote;
+    size_t numExpected = 0;
+    for (size_t tileID = 0; tileID < numTiles; tileID++) {
+      if (heldBgTiles[tileID]) {
+        numExpected += numNonEmpty[tileID] - heldTiles[tileID].size();
+      } else {
+        for (auto &tile : heldTiles[tileID]) {
+          remote.push_back(std::make_pair(int32(tileID), tile.get()));
+        }
       }
     }
+    std::vector<std::vector<uint8>> messages(remote.size());
+    parallel_for(remote.size(), [&](int i){
+      const Tile &tile = *remote[i].second;
+      std::vector<uint8> &msg = messages[i];
+      msg.resize(sizeof(ISPEncodedTile) + 5 * TILE_SIZE * TILE_SIZE * sizeof(uint16));
+      ISPEncodedTile *header = reinterpret_cast<ISPEncodedTile*>(msg.data());
+      uint16 *values = reinterpret_cast<uint16*>(msg.data() + sizeof(ISPEncodedTile));
+      header->tileID = remote[i].first;
+      header->accumID = tile.accumID;
+      header->numCovered = ispc::ISPRenderer_encodeTile((ispc::Tile&)tile, header->mask,
+          values, header->zLo, header->zHi);
+      msg.resize(sizeof(ISPEncodedTile) + 5 * header->numCovered * sizeof(uint16));
+    });
+    std::vector<MPI_Request> requests(remote.size());
+    for (size_t i = 0; i < remote.size(); i++) {
+      MPI_CALL(Isend(messages[i].data(), messages[i].size(), MPI_BYTE,
+            remote[i].first % numWorkers, tag, comm, &requests[i]));
+    }
+
+    // our own tiles go to our part of the frame buffer as they are
+    parallel_for(numTiles, [&](int tileID){
+      if (!heldBgTiles[tileID]) {
+        return;
+      }
+      heldBgTiles[tileID]->children = numNonEmpty[tileID];
+      fb->setTile(*heldBgTiles[tileID]);
+      for (auto &tile : heldTiles[tileID]) {
+        fb->setTile(*tile);
+      }
+    });
+
+    std::vector<uint8> msg;
+    for (size_t i = 0; i < numExpected; i++) {
+      MPI_Status status;
+      MPI_CALL(Probe(MPI_ANY_SOURCE, tag, comm, &status));
+      int size = 0;
+      MPI_CALL(Get_count(&status, MPI_BYTE, &size));
+      msg.resize(size);
+      MPI_CALL(Recv(msg.data(), size, MPI_BYTE, status.MPI_SOURCE, tag, comm, MPI_STATUS_IGNORE));
+      const ISPEncodedTile *header = reinterpret_cast<const ISPEncodedTile*>(msg.data());
+      const uint16 *values = reinterpret_cast<const uint16*>(msg.data() + sizeof(ISPEncodedTile));
+      const vec2i tileId(header->tileID % numTiles_x, header->tileID / numTiles_x);
+      Tile tile(tileId, fb->size, header->accumID);
+      ispc::ISPRenderer_decodeTile((ispc::Tile&)tile, header->mask, values,
+          header->numCovered, header->zLo, header->zHi);
+      tile.generation = 1;
+      tile.children = 0;
+      fb->setTile(tile);
+    }
+    MPI_CALL(Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE));
+
+#if ISP_TILE_STATS
+    size_t compressedBytes = 0;
+    for (const auto &m : messages) {
+      compressedBytes += m.size();
+    }
+    std::cout << "#ospray:ISPRenderer: rank " << core::getWorkerRank() << " sent " << remote.size()
+      << " block tiles in " << compressedBytes << " bytes, "
+      << remote.size() * 5 * TILE_SIZE * TILE_SIZE * sizeof(float) << " bytes uncompressed\n";
+#endif
+    for (size_t tileID = 0; tileID < numTiles; tileID++) {
+      heldBgTiles[tileID].reset();
+      heldTiles[tileID].clear();
+    }
   }
-  Tile* ISPCacheForTiles::allocTile() const {
-    const float infinity = std::numeric_limits<float>::infinity();
-    Tile *tile = new Tile;
-    for (int i = 0; i < TILE_SIZE*TILE_SIZE; i++) {
-      tile->r[i] = 0.f;
-      tile->g[i] = 0.f;
-      tile->b[i] = 0.f;
-      tile->a[i] = 0.f;
-      tile->z[i] = infinity;
+
+  void ISPTileArena::reserve(size_t numSlots, size_t numBlocks) {
+    if (numBlocks > slotOfBlock.size()) {
+      slotOfBlock.resize(numBlocks, -1);
+    }
+    if (numSlots <= tiles.size()) {
+      return;
+    }
+    std::unique_ptr<std::atomic<int>[]> newState(new std::atomic<int>[numSlots]);
+    for (size_t i = 0; i < numSlots; i++) {
+      newState[i] = ISPCacheForTiles::SLOT_UNUSED;
+    }
+    state = std::move(newState);
+    while (tiles.size() < numSlots) {
+      tiles.emplace_back(new Tile);
     }
-    return tile;
+  }
+
+  /*! The arenas of this thread. A thread waiting for the jobs of its
+   * tile may pick up another tile task, which then gets the next arena
+   */
+  static thread_local std::vector<std::unique_ptr<ISPTileArena>> threadArenas;
+  static thread_local size_t threadArenasInUse = 0;
+
+  ISPCacheForTiles::ISPCacheForTiles(size_t numBlocks, const int32 *renderedBlocks,
+      size_t numRendered)
+    : renderedBlocks(renderedBlocks), numRendered(numRendered)
+  {
+    if (threadArenasInUse == threadArenas.size()) {
+      threadArenas.emplace_back(new ISPTileArena);
+    }
+    arena = threadArenas[threadArenasInUse++].get();
+    arena->reserve(numRendered, numBlocks);
+    for (size_t i = 0; i < numRendered; i++) {
+      arena->slotOfBlock[renderedBlocks[i]] = i;
+    }
+  }
+  ISPCacheForTiles::~ISPCacheForTiles() {
+    // leave the arena as we found it for the next tile
+    for (size_t i = 0; i < numRendered; i++) {
+      arena->slotOfBlock[renderedBlocks[i]] = -1;
+      arena->state[i] = SLOT_UNUSED;
+    }
+    --threadArenasInUse;
   }
   Tile* ISPCacheForTiles::getTileForBlock(size_t blockID) {
-    Tile *&tile = blockTiles[blockID];
-    if (tile != nullptr) {
+    const int32 slot = arena->slotOfBlock[blockID];
+    assert(slot >= 0);
+    std::atomic<int> &state = arena->state[slot];
+    Tile *tile = arena->tiles[slot].get();
+    if (state.load(std::memory_order_acquire) == SLOT_READY) {
       return tile;
     }
-    std::lock_guard<std::mutex> lock(mutex);
-    if (tile == nullptr) {
-      tile = allocTile();
+    int expected = SLOT_UNUSED;
+    if (state.compare_exchange_strong(expected, SLOT_CLEARING)) {
+      ispc::ISPRenderer_clearTile((ispc::Tile&)*tile);
+      state.store(SLOT_READY, std::memory_order_release);
+    } else {
+      // someone else claimed it, it's only ever cleared once
+      while (state.load(std::memory_order_acquire) != SLOT_READY) {
+        std::this_thread::yield();
+      }
     }
     return tile;
   }
+  Tile* ISPCacheForTiles::renderedTile(size_t blockID) const {
+    const int32 slot = arena->slotOfBlock[blockID];
+    if (slot < 0 || arena->state[slot] != SLOT_READY) {
+      return nullptr;
+    }
+    return arena->tiles[slot].get();
+  }
   extern "C" Tile*
   ISPCacheForTiles_getTile(ISPCacheForTiles *cache, const int32_t blockID) {
     return cache->getTileForBlock(blockID);
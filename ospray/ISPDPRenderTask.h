@@ -1,9 +1,12 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
 #include "OSPConfig.h"
 
 #include "ospray/render/Renderer.h"
 #include "ospray/fb/FrameBuffer.h"
+#include "ospray/mpi/MPICommon.h"
 #include "ospray/InSituSpheres.h"
 
 namespace ospray {
@@ -14,14 +17,34 @@ namespace ospray {
     size_t numTiles_y;
     uint32 channelFlags;
     InSituSpheres *isSpheres;
+    /*! if set, the tasks hold back the block tiles where rays hit
+     * particles instead of sending every tile the rays passed through,
+     * and sendHeldTiles sends them once the ranks agreed on how many
+     * each tile gets
+     */
+    bool skipEmptyTiles;
+    /*! if set (implies skipEmptyTiles), the held block tiles of tiles
+     * owned by other ranks go to their owner in the compressed
+     * ISPEncodedTile form, which decodes them and hands them to its part
+     * of the frame buffer, instead of as full float tiles through the
+     * frame buffer
+     */
+    bool compressTiles;
+    // Per tile: our non-empty block tiles, and the background tile if it's ours
+    mutable std::vector<std::vector<std::unique_ptr<Tile>>> heldTiles;
+    mutable std::vector<std::unique_ptr<Tile>> heldBgTiles;
 
     struct ISPCDDSpheresBlock {
       // The actual grid domain assigned for this block
       box3f actualDomain;
+      // The part of it covered by the block's particles, and their
+      // occupancy grid, see InSituSpheres::DDSpheres
+      box3f tightBounds;
       int firstOwner;
       int numOwners;
       int isMine;
       int blockID;
+      uint64 occupancy;
 
       // TODO: The special renderer will know how to deal with the
       // clipping of primary rays against the actual domain, the PKD
@@ -32,22 +55,78 @@ namespace ospray {
     // Because the layouts don't match anymore we need a seprate copy
     // of the blocks that we can share with ISPC
     std::vector<ISPCDDSpheresBlock> pkdBlocks;
+    //! tiles [lower,upper] a block's bounds project to, inclusive
+    struct TileRange {
+      vec2i lower, upper;
+    };
+    /*! the tiles each block may cover this frame, so a tile only has
+        to look at the blocks it can see. all tiles for a block if the
+        camera doesn't allow projecting it, see projectBlockTiles */
+    std::vector<TileRange> blockTiles;
+    /*! distance of each block's bounds from the camera, the tiles
+     * render their blocks nearest first. all 0 if the camera doesn't
+     * allow projecting them
+     */
+    std::vector<float> blockDistance;
 
     ISPDPRenderTask(Ref<Renderer> renderer, Ref<FrameBuffer> fb,
         size_t numTiles_x, size_t numTiles_y, uint32 channelFlags,
-        InSituSpheres *isSpheres);
+        InSituSpheres *isSpheres, bool skipEmptyTiles, bool compressTiles);
 
     void operator()(int taskID) const;
+    //! compute blockTiles for the renderer's current camera
+    void projectBlockTiles();
+    /*! with skipEmptyTiles, sum the number of non-empty block tiles of
+     * each tile over the ranks in 'comm', and send the held tiles. the
+     * compressed tiles go over 'comm' too
+     */
+    void sendHeldTiles(MPI_Comm comm);
+    // The compressTiles part of sendHeldTiles, given the summed counts
+    void sendCompressedTiles(MPI_Comm comm, const std::vector<int32> &numNonEmpty);
+  };
+  /*! Header of a compressed block tile as sent to the tile's owner, see
+   * ISPRenderer_encodeTile. Followed by the 5*numCovered uint16 values
+   * of the covered pixels
+   */
+  struct ISPEncodedTile {
+    int32 tileID;
+    int32 accumID;
+    int32 numCovered;
+    // Range the depths are quantized over
+    float zLo, zHi;
+    // One bit per pixel, set if it's covered
+    uint32 mask[TILE_SIZE*TILE_SIZE/32];
+  };
+  /*! The block tiles of a tile task, kept per thread and reused over
+   * tasks and frames so rendering a tile doesn't allocate. Grows to the
+   * most blocks a tile of this thread rendered so far
+   */
+  struct ISPTileArena {
+    // One tile per slot, the blocks rendered for the current tile get a
+    // slot each
+    std::vector<std::unique_ptr<Tile>> tiles;
+    // Per slot: SLOT_UNUSED, SLOT_CLEARING or SLOT_READY
+    std::unique_ptr<std::atomic<int>[]> state;
+    // Slot of each block for the current tile, -1 if we don't render it
+    std::vector<int32> slotOfBlock;
+
+    void reserve(size_t numSlots, size_t numBlocks);
   };
-  // This is the data-distributed renderer's cache for block's tiles
+  // This is the data-distributed renderer's cache for block's tiles,
+  // claiming the tiles from this thread's ISPTileArena
   struct ISPCacheForTiles {
-    std::vector<Tile*> blockTiles;
-    std::mutex mutex;
+    enum { SLOT_UNUSED, SLOT_CLEARING, SLOT_READY };
+    ISPTileArena *arena;
+    const int32 *renderedBlocks;
+    size_t numRendered;
 
-    ISPCacheForTiles(size_t numBlocks);
+    // Only the 'numRendered' blocks in 'renderedBlocks' may be asked for
+    ISPCacheForTiles(size_t numBlocks, const int32 *renderedBlocks, size_t numRendered);
     ~ISPCacheForTiles();
-    Tile* allocTile() const;
+    // The tile of 'blockID', cleared by whichever thread asks for it first
     Tile* getTileForBlock(size_t blockID);
+    // The tile of 'blockID' if any of its pixels got rendered, else NULL
+    Tile* renderedTile(size_t blockID) const;
   };
 }
 
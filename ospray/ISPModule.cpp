@@ -65,13 +65,17 @@ namespace isp {
     return geometry;
   }
 
-  ospray::cpp::Geometry pollSim(ospray::cpp::Renderer renderer, const std::string &server,
+  ospray::cpp::Geometry pollSimConfigured(ospray::cpp::Renderer renderer, const std::string &server,
       const int port, const float radius, const float pollRate, box3f &bounds,
-      std::function<void (ospray::cpp::Geometry, const box3f&)> callback)
+      std::function<void (ospray::cpp::Geometry, const box3f&)> callback,
+      std::function<void (ospray::cpp::Geometry)> configure)
   {
     using namespace ospray::cpp;
     Geometry geometry = setupInSituSpheres(renderer, server, port, radius);
     geometry.set("poll_rate", pollRate);
+    if (configure) {
+      configure(geometry);
+    }
     geometry.commit();
 
     // Do a single blocking query then spawn a thread to notify us in the future
@@ -93,12 +97,23 @@ namespace isp {
     return geometry;
   }
 
-  ospray::cpp::Geometry pollOnce(ospray::cpp::Renderer renderer, const std::string &server,
-      const int port, const float radius, box3f &bounds)
+  ospray::cpp::Geometry pollSim(ospray::cpp::Renderer renderer, const std::string &server,
+      const int port, const float radius, const float pollRate, box3f &bounds,
+      std::function<void (ospray::cpp::Geometry, const box3f&)> callback)
+  {
+    return pollSimConfigured(renderer, server, port, radius, pollRate, bounds, callback, nullptr);
+  }
+
+  ospray::cpp::Geometry pollOnceConfigured(ospray::cpp::Renderer renderer, const std::string &server,
+      const int port, const float radius, box3f &bounds,
+      std::function<void (ospray::cpp::Geometry)> configure)
   {
     using namespace ospray::cpp;
     Geometry geometry = setupInSituSpheres(renderer, server, port, radius);
     geometry.set("poll_rate", -1);
+    if (configure) {
+      configure(geometry);
+    }
     geometry.commit();
 
     // Wait for the geometry to actually get data from the simulation
@@ -106,9 +121,18 @@ namespace isp {
           ospray::mpi::world.comm, MPI_STATUS_IGNORE));
     return geometry;
   }
+
+  ospray::cpp::Geometry pollOnce(ospray::cpp::Renderer renderer, const std::string &server,
+      const int port, const float radius, box3f &bounds)
+  {
+    return pollOnceConfigured(renderer, server, port, radius, bounds, nullptr);
+  }
+
   void registerModule(cs::ChaiScript &engine) {
     engine.add(cs::fun(&pollOnce), "ispPollOnce");
+    engine.add(cs::fun(&pollOnceConfigured), "ispPollOnce");
     engine.add(cs::fun(&pollSim), "ispPollSim");
+    engine.add(cs::fun(&pollSimConfigured), "ispPollSim");
   }
   void printHelp() {
     std::cout << "==In Situ Particles Module Help==\n"
@@ -121,6 +145,9 @@ namespace isp {
       << "      Connect to the simulation running on 'server' listening at 'port'\n"
       << "      and query particle data from it. Returns the geometry and world bounds\n"
       << "      of the first poll and calls the 'callback' for continuing queries\n"
+      << "\n"
+      << "    Both functions also take an optional trailing 'configure(geometry)' callback,\n"
+      << "    which is called before the first commit to set further geometry parameters\n"
       << "====\n";
   }
   extern "C" void ospray_init_module_in_situ_particles() {
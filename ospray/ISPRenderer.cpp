@@ -26,15 +26,25 @@
 #include "ospray/mpi/DistributedFrameBuffer.h"
 #include "ospray/render/LoadBalancer.h"
 #include "ospray/common/Core.h"
+#include "ospray/mpi/MPICommon.h"
+
+#include "../testing_defines.h"
 
 namespace ospray {
   //! \brief Constructor
   ISPRenderer::ISPRenderer(int defaultNumSamples)
-    : defaultNumSamples(defaultNumSamples)
+    : defaultNumSamples(defaultNumSamples), skipEmptyTiles(false), compressTiles(false),
+      tileCountComm(MPI_COMM_NULL)
   {
     ispcEquivalent = ispc::ISPRenderer_create(this,NULL,NULL);
+    if (ospray::core::isMpiParallel()) {
+      MPI_CALL(Comm_dup(ospray::mpi::worker.comm, &tileCountComm));
+    }
   }
   ISPRenderer::~ISPRenderer() {
+    if (tileCountComm != MPI_COMM_NULL) {
+      MPI_Comm_free(&tileCountComm);
+    }
   }
 
   /*! \brief create a material of given type */
@@ -57,7 +67,10 @@ namespace ospray {
 
     int   numSamples = getParam1i("aoSamples", defaultNumSamples);
     float rayLength  = getParam1f("aoOcclusionDistance", 1e20f);
-    ispc::ISPRenderer_set(getIE(), numSamples, rayLength);
+    bool  aoStream   = getParam1i("aoStream", 0);
+    skipEmptyTiles   = getParam1i("skipEmptyTiles", 0);
+    compressTiles    = getParam1i("compressTiles", 0);
+    ispc::ISPRenderer_set(getIE(), numSamples, rayLength, aoStream);
   }
 
   float ISPRenderer::renderFrame(FrameBuffer *fb, const uint32 fbChannelFlags) {
@@ -101,12 +114,56 @@ namespace ospray {
 
     // create the render task
     ISPDPRenderTask renderTask(this, fb, divRoundUp(dfb->size.x,TILE_SIZE),
-        divRoundUp(dfb->size.y,TILE_SIZE), fbChannelFlags, isSpheres);
+        divRoundUp(dfb->size.y,TILE_SIZE), fbChannelFlags, isSpheres, skipEmptyTiles,
+        compressTiles);
 
     const size_t NTASKS = renderTask.numTiles_x * renderTask.numTiles_y;
     parallel_for(NTASKS, renderTask);
+    if (renderTask.skipEmptyTiles) {
+      renderTask.sendHeldTiles(tileCountComm);
+    }
 
     dfb->waitUntilFinished();
+#if PKD_CULLING_STATS
+    size_t numNodesTested = 0, numNodesCulled = 0;
+    for (auto &spheres : isSpheres->ddSpheres) {
+      if (spheres.isMine && spheres.pkd) {
+        size_t tested = 0, culled = 0;
+        spheres.pkd->takeCullingStats(tested, culled);
+        numNodesTested += tested;
+        numNodesCulled += culled;
+      }
+    }
+    if (numNodesTested > 0) {
+      std::cout << "#ospray:ISPRenderer: rank " << workerRank << " culled "
+        << 100.f * numNodesCulled / float(numNodesTested) << "% of the "
+        << numNodesTested << " pkd nodes tested\n";
+    }
+#endif
+#if PKD_LANE_STATS
+    for (int site = 0; site < 2; ++site) {
+      PartiKDGeometry::LaneStats total = {0,0,0,0,0};
+      for (auto &spheres : isSpheres->ddSpheres) {
+        if (spheres.isMine && spheres.pkd) {
+          PartiKDGeometry::LaneStats stats;
+          spheres.pkd->takeLaneStats(site == 1, stats);
+          total.numPackets      += stats.numPackets;
+          total.numSPMDPackets  += stats.numSPMDPackets;
+          total.numStepLanes    += stats.numStepLanes;
+          total.numActiveLanes  += stats.numActiveLanes;
+          total.numSPMDSwitches += stats.numSPMDSwitches;
+        }
+      }
+      if (total.numPackets > 0) {
+        std::cout << "#ospray:ISPRenderer: rank " << workerRank
+          << (site == 1 ? " occluded: " : " intersect: ") << total.numPackets << " packets, "
+          << 100.f * total.numSPMDPackets / float(total.numPackets) << "% traced per lane, "
+          << 100.f * total.numActiveLanes / float(std::max(total.numStepLanes,size_t(1)))
+          << "% lane utilization in packet steps, "
+          << total.numSPMDSwitches << " switches to per lane\n";
+      }
+    }
+#endif
     Renderer::endFrame(NULL, fbChannelFlags);
     return fb->endFrame(0.f);
   }
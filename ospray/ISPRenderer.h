@@ -46,6 +46,15 @@ namespace ospray {
     std::vector<void*> lightArray; // the 'IE's of the XXXLights
     Data *lightData;
     int defaultNumSamples;
+    //! see ISPDPRenderTask::skipEmptyTiles
+    bool skipEmptyTiles;
+    //! see ISPDPRenderTask::compressTiles
+    bool compressTiles;
+    /*! our own copy of the worker communicator for agreeing on the
+     * tile counts, so it doesn't interleave with the collectives
+     * the InSituSpheres polling thread runs on the workers
+     */
+    MPI_Comm tileCountComm;
   };
 }
 
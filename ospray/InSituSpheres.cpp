@@ -32,7 +32,11 @@
 namespace ospray {
   const std::string attribute_name = "attrib";
 
-  InSituSpheres::InSituSpheres() : simPollerShouldExit(false) {}
+  InSituSpheres::InSituSpheres()
+    : refit(false), bucketSize(0), treeletDepth(0), quantize(false), attributeBits(32),
+      subtreeDepth(0), boundsDepth(0), hybridThreshold(.5f),
+      lodDepth(0), lodThreshold(0.f), occupancyGrid(false), simPollerShouldExit(false)
+  {}
 
   InSituSpheres::~InSituSpheres() {
     simPollerShouldExit = true;
@@ -67,6 +71,39 @@ namespace ospray {
     server = getParamString("server_name", NULL);
     poll_delay = getParam1f("poll_rate", -1.f);
     port = getParam1i("port", -1);
+    refit = getParam1i("refit", 0);
+    bucketSize = getParam1i("bucketSize", 0);
+    if (refit && bucketSize > 0) {
+      std::cout << "#ospray:geometry/InSituSpheres: refitting bucketed pkds is not "
+        "supported, rebuilding them every timestep\n";
+    }
+    treeletDepth = getParam1i("treeletDepth", 0);
+    if (treeletDepth > 0 && bucketSize > 0) {
+      std::cout << "#ospray:geometry/InSituSpheres: bucketed pkds can't be stored "
+        "in treelet order, ignoring treeletDepth\n";
+      treeletDepth = 0;
+    } else if (refit && treeletDepth > 0) {
+      std::cout << "#ospray:geometry/InSituSpheres: refitting pkds in treelet order is not "
+        "supported, rebuilding them every timestep\n";
+    }
+    quantize = getParam1i("quantize", 0);
+    if (quantize && bucketSize > 0) {
+      std::cout << "#ospray:geometry/InSituSpheres: bucketed pkds can't be quantized, "
+        "ignoring quantize\n";
+      quantize = false;
+    }
+    attributeBits = getParam1i("attributeBits", 32);
+    if (attributeBits != 8 && attributeBits != 16 && attributeBits != 32) {
+      std::cout << "#ospray:geometry/InSituSpheres: attributeBits must be 8, 16 or 32, "
+        "storing float attributes\n";
+      attributeBits = 32;
+    }
+    subtreeDepth = getParam1i("subtreeDepth", 0);
+    boundsDepth = getParam1i("boundsDepth", 0);
+    hybridThreshold = getParam1f("hybridThreshold", .5f);
+    lodDepth = getParam1i("lodDepth", 0);
+    lodThreshold = getParam1f("lodThreshold", 0.f);
+    occupancyGrid = getParam1i("occupancyGrid", 0);
     if (server.empty() || port == -1){
       throw std::runtime_error("#ospray:geometry/InSituSpheres: No simulation server and/or port specified");
     }
@@ -124,6 +161,8 @@ namespace ospray {
     int rank = ospray::mpi::worker.rank;
     int size = ospray::mpi::worker.size;
     nextDDSpheres.clear();
+    size_t numNodes = 0;
+    size_t numBuilt = 0;
     for (size_t i = 0; i < dd->numBlocks; ++i) {
       const DomainGrid::Block &b = dd->block[i];
       DDSpheres spheres;
@@ -131,17 +170,35 @@ namespace ospray {
       spheres.firstOwner = b.firstOwner;
       spheres.numOwners = b.numOwners;
       spheres.isMine = b.isMine;
+      spheres.tightBounds = empty;
+      spheres.occupancy = 0;
       nextDDSpheres.push_back(spheres);
       if (b.isMine) {
-        buildPKDBlock(b, nextDDSpheres.back());
+        const DDSpheres *prev = nullptr;
+        if (refit && i < prevDDSpheres.size() && prevDDSpheres[i].ids) {
+          prev = &prevDDSpheres[i];
+        }
+        numBuilt += buildPKDBlock(b, nextDDSpheres.back(), prev);
+        numNodes += b.particle.size() / OSP_IS_STRIDE_IN_FLOATS;
       }
     }
+    exchangeBlockBounds(nextDDSpheres);
+    if (refit) {
+      if (numNodes > 0) {
+        std::cout << "#ospray:geometry/InSituSpheres: rank " << rank << " rebuilt "
+          << 100.f * numBuilt / float(numNodes) << "% of pkd nodes\n";
+      }
+      prevDDSpheres = nextDDSpheres;
+    } else {
+      prevDDSpheres.clear();
+    }
 
 #if PRINT_FULL_PARTICLE_COUNT
     uint64_t num_particles = 0;
     for (const auto &b : nextDDSpheres) {
       if (b.firstOwner == rank) {
-        num_particles += b.positions->size();
+        num_particles += b.bucketPositions ? b.bucketPositions->size() / 3
+          : b.quantizedPositions ? b.quantizedPositions->size() : b.positions->size();
       }
     }
     uint64_t total_particles = 0;
@@ -181,6 +238,20 @@ namespace ospray {
       if (ddspheres.isMine && ddspheres.pkd) {
         ddspheres.pkd->findParam("attribute_low", 1)->set(attr_lo);
         ddspheres.pkd->findParam("attribute_high", 1)->set(attr_hi);
+        if (attributeBits < 32 && !ddspheres.attributes->empty()) {
+          // Now that we know the global range we can normalize the attributes
+          // into their compact form
+          ddspheres.compactAttributes = std::make_shared<std::vector<uint8>>(
+              compactAttribute(*ddspheres.attributes, attr_lo, attr_hi, attributeBits));
+          Data *attribData = new Data(ddspheres.attributes->size(),
+              attributeBits == 8 ? OSP_UCHAR : OSP_USHORT,
+              ddspheres.compactAttributes->data(), OSP_DATA_SHARED_BUFFER);
+          ddspheres.pkd->findParam("attribute", 1)->set(attribData);
+          // The float attributes are only needed to refit the next timestep
+          if (!refit) {
+            ddspheres.attributes = std::make_shared<std::vector<float>>();
+          }
+        }
       }
     }
 
@@ -192,7 +263,64 @@ namespace ospray {
     delete dd;
   }
 
-  void InSituSpheres::buildPKDBlock(const DomainGrid::Block &b, DDSpheres &ddspheres) const {
+  void InSituSpheres::exchangeBlockBounds(std::vector<DDSpheres> &blocks) const {
+    // Blocks we don't own contribute empty bounds and no cells, the upper
+    // bounds are negated so a single min reduction gives the union
+    std::vector<float> bounds(6 * blocks.size());
+    std::vector<uint64_t> occupancy(blocks.size());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      const box3f &b = blocks[i].tightBounds;
+      bounds[6 * i] = b.lower.x;
+      bounds[6 * i + 1] = b.lower.y;
+      bounds[6 * i + 2] = b.lower.z;
+      bounds[6 * i + 3] = -b.upper.x;
+      bounds[6 * i + 4] = -b.upper.y;
+      bounds[6 * i + 5] = -b.upper.z;
+      occupancy[i] = blocks[i].occupancy;
+    }
+    MPI_CALL(Allreduce(MPI_IN_PLACE, bounds.data(), bounds.size(), MPI_FLOAT, MPI_MIN,
+          ospray::mpi::worker.comm));
+    MPI_CALL(Allreduce(MPI_IN_PLACE, occupancy.data(), occupancy.size(), MPI_UINT64_T, MPI_BOR,
+          ospray::mpi::worker.comm));
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      blocks[i].tightBounds = box3f(vec3f(bounds[6 * i], bounds[6 * i + 1], bounds[6 * i + 2]),
+          vec3f(-bounds[6 * i + 3], -bounds[6 * i + 4], -bounds[6 * i + 5]));
+      blocks[i].occupancy = occupancy[i];
+    }
+  }
+
+  /*! The cells of a BLOCK_OCCUPANCY_RES^3 grid over 'bounds' overlapped by
+   * any of the spheres, one bit per cell with x varying fastest
+   */
+  static uint64 occupancyMask(const std::vector<vec3f> &position, const float radius,
+      const box3f &bounds)
+  {
+    const vec3f cellScale = vec3f(BLOCK_OCCUPANCY_RES) / (bounds.upper - bounds.lower);
+    auto cellOf = [&](const float p, const float lo, const float scale) {
+      return std::min(std::max(int((p - lo) * scale), 0), BLOCK_OCCUPANCY_RES - 1);
+    };
+    uint64 mask = 0;
+    for (const vec3f &p : position) {
+      const vec3i lo(cellOf(p.x - radius, bounds.lower.x, cellScale.x),
+          cellOf(p.y - radius, bounds.lower.y, cellScale.y),
+          cellOf(p.z - radius, bounds.lower.z, cellScale.z));
+      const vec3i hi(cellOf(p.x + radius, bounds.lower.x, cellScale.x),
+          cellOf(p.y + radius, bounds.lower.y, cellScale.y),
+          cellOf(p.z + radius, bounds.lower.z, cellScale.z));
+      for (int z = lo.z; z <= hi.z; ++z) {
+        for (int y = lo.y; y <= hi.y; ++y) {
+          for (int x = lo.x; x <= hi.x; ++x) {
+            mask |= uint64(1) << (x + BLOCK_OCCUPANCY_RES * (y + BLOCK_OCCUPANCY_RES * z));
+          }
+        }
+      }
+    }
+    return mask;
+  }
+
+  size_t InSituSpheres::buildPKDBlock(const DomainGrid::Block &b, DDSpheres &ddspheres,
+      const DDSpheres *prev) const
+  {
     ParticleModel model;
     PartiKD partikd;
     model.radius = radius;
@@ -223,7 +351,20 @@ namespace ospray {
     if (model.position.empty()){
       std::cout << "Warning " << mpi::worker.rank << " has no data loaded\n";
       ddspheres.pkd = nullptr;
-      return;
+      return 0;
+    }
+    // The part of our domain the spheres actually cover, for the renderer to
+    // clip rays to
+    const box3f sphereBounds = model.getBounds();
+    ddspheres.tightBounds = intersectionOf(box3f(sphereBounds.lower - vec3f(radius),
+          sphereBounds.upper + vec3f(radius)), b.actualDomain);
+    const vec3f tightSize = ddspheres.tightBounds.upper - ddspheres.tightBounds.lower;
+    if (tightSize.x <= 0.f || tightSize.y <= 0.f || tightSize.z <= 0.f) {
+      ddspheres.tightBounds = box3f(empty);
+      ddspheres.occupancy = 0;
+    } else {
+      ddspheres.occupancy = occupancyGrid
+        ? occupancyMask(model.position, radius, ddspheres.tightBounds) : ~uint64(0);
     }
     // We've got our positions so now send it to the ospray geometry
     if (model.position.size() >= (1ULL << 30)) {
@@ -235,23 +376,100 @@ namespace ospray {
           "put that many InSituSpheres into a single geometry "
           "without causing address overflows)");
     }
-    // Build the pkd tree on the particles
-    partikd.build(&model);
+    const bool refitBlock = refit && bucketSize <= 0 && treeletDepth <= 0;
+    if (refitBlock) {
+      // The particles are identified by the order they arrived in
+      model.id.resize(model.position.size());
+      for (size_t i = 0; i < model.id.size(); ++i) {
+        model.id[i] = i;
+      }
+    }
+
+    // Build the pkd tree on the particles, or if we've got the tree from the
+    // previous timestep for the same set of particles just refit that one
+    ParticleModel prevModel;
+    ParticleModel *pkdModel = &model;
+    size_t numBuilt = model.position.size();
+    if (prev && prev->ids->size() == model.position.size()) {
+      prevModel.radius = model.radius;
+      prevModel.position = *prev->positions;
+      prevModel.id = *prev->ids;
+      if (model.hasAttribute(attribute_name)) {
+        prevModel.getAttribute(attribute_name)->value = *prev->attributes;
+      }
+      const float rebuilt = partikd.refit(&prevModel, model);
+      numBuilt = rebuilt * model.position.size();
+      pkdModel = &prevModel;
+    } else if (bucketSize > 0) {
+      partikd.buildBucketed(&model, bucketSize);
+    } else {
+      partikd.build(&model);
+      if (treeletDepth > 0) {
+        partikd.reorderTreelets(treeletDepth);
+      }
+    }
 
-    ddspheres.positions = std::make_shared<std::vector<vec3f>>(std::move(model.position));
-    ddspheres.attributes = std::make_shared<std::vector<float>>(std::move(model.getAttribute(attribute_name)->value));
-    // TODO: The positions data is being lost??
-    Data *posData = new Data(ddspheres.positions->size(), OSP_FLOAT3, ddspheres.positions->data(),
-        OSP_DATA_SHARED_BUFFER);
+    Data *posData = nullptr;
     ddspheres.pkd = new PartiKDGeometry;
+    if (bucketSize > 0) {
+      ddspheres.bucketPositions = std::make_shared<std::vector<float>>(partikd.bucketPositionsSoA());
+      ddspheres.splitPlanes = std::make_shared<std::vector<float>>(std::move(partikd.splitPlane));
+      ddspheres.positions = std::make_shared<std::vector<vec3f>>();
+      posData = new Data(ddspheres.bucketPositions->size(), OSP_FLOAT,
+          ddspheres.bucketPositions->data(), OSP_DATA_SHARED_BUFFER);
+      Data *splitPlaneData = new Data(ddspheres.splitPlanes->size(), OSP_FLOAT,
+          ddspheres.splitPlanes->data(), OSP_DATA_SHARED_BUFFER);
+      ddspheres.pkd->findParam("splitPlane", 1)->set(splitPlaneData);
+      ddspheres.pkd->findParam("bucketSize", 1)->set(bucketSize);
+    } else if (quantize) {
+      // Quantize relative to the block's ghost bounds, grown to cover any
+      // particles the sim sent outside of them
+      ddspheres.quantizationBounds = b.ghostDomain;
+      ddspheres.quantizationBounds.extend(pkdModel->getBounds());
+      ddspheres.quantizedPositions = std::make_shared<std::vector<uint64>>(
+          partikd.quantizedPositions(ddspheres.quantizationBounds));
+      // The float positions are only needed to refit the next timestep
+      ddspheres.positions = std::make_shared<std::vector<vec3f>>();
+      if (refitBlock) {
+        *ddspheres.positions = std::move(pkdModel->position);
+      }
+      posData = new Data(ddspheres.quantizedPositions->size(), OSP_ULONG,
+          ddspheres.quantizedPositions->data(), OSP_DATA_SHARED_BUFFER);
+      ddspheres.pkd->findParam("quantizationLower", 1)->set(ddspheres.quantizationBounds.lower);
+      ddspheres.pkd->findParam("quantizationUpper", 1)->set(ddspheres.quantizationBounds.upper);
+    } else {
+      ddspheres.positions = std::make_shared<std::vector<vec3f>>(std::move(pkdModel->position));
+      // TODO: The positions data is being lost??
+      posData = new Data(ddspheres.positions->size(), OSP_FLOAT3, ddspheres.positions->data(),
+          OSP_DATA_SHARED_BUFFER);
+    }
+    ddspheres.attributes = std::make_shared<std::vector<float>>(std::move(pkdModel->getAttribute(attribute_name)->value));
+    if (refitBlock) {
+      ddspheres.ids = std::make_shared<std::vector<uint32>>(std::move(pkdModel->id));
+    }
 
     ddspheres.pkd->findParam("position", 1)->set(posData);
     ddspheres.pkd->findParam("radius", 1)->set(model.radius);
+    if (partikd.treelets.depth > 0) {
+      ddspheres.pkd->findParam("treeletDepth", 1)->set(partikd.treelets.depth);
+    }
+    if (subtreeDepth > 0) {
+      ddspheres.pkd->findParam("subtreeDepth", 1)->set(subtreeDepth);
+    }
+    if (boundsDepth > 0) {
+      ddspheres.pkd->findParam("boundsDepth", 1)->set(boundsDepth);
+    }
+    ddspheres.pkd->findParam("hybridThreshold", 1)->set(hybridThreshold);
+    if (lodDepth > 0 && lodThreshold > 0.f) {
+      ddspheres.pkd->findParam("lodDepth", 1)->set(lodDepth);
+      ddspheres.pkd->findParam("lodThreshold", 1)->set(lodThreshold);
+    }
     if (!ddspheres.attributes->empty()) {
       Data *attribData = new Data(ddspheres.attributes->size(), OSP_FLOAT, ddspheres.attributes->data(),
           OSP_DATA_SHARED_BUFFER);
       ddspheres.pkd->findParam("attribute", 1)->set(attribData);
     }
+    return numBuilt;
   }
 
   OSP_REGISTER_GEOMETRY(InSituSpheres,InSituSpheres);
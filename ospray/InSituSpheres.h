@@ -38,16 +38,34 @@ namespace ospray {
     struct DDSpheres {
       // The actual grid domain assigned for this block
       box3f actualDomain;
-      // The full domain spanned by the particles in the block, accounting
-      // for ghost regions + particle radii
-      // TODO: I don't think we need this, the pkd tracks this
-      //box3f sphereBounds;
+      // The bounds of the particle spheres in the block (including the ghost
+      // ones) clipped to the actual domain, empty if it has no particles.
+      // Known for all blocks, not just ours, see exchangeBlockBounds
+      box3f tightBounds;
+      // One bit per cell of a BLOCK_OCCUPANCY_RES^3 grid over tightBounds,
+      // set if a particle sphere overlaps the cell. All set if we don't
+      // build the occupancy grids
+      uint64 occupancy;
       int firstOwner;
       int numOwners;
       int isMine;
       // The position and attribute data shared with the pkd geometry
       std::shared_ptr<std::vector<vec3f>> positions;
       std::shared_ptr<std::vector<float>> attributes;
+      // The particle IDs in pkd order, only kept if we're refitting
+      std::shared_ptr<std::vector<uint32>> ids;
+      // The x[],y[],z[] bucket positions and split planes of bucketed pkds,
+      // positions is empty for these
+      std::shared_ptr<std::vector<float>> bucketPositions;
+      std::shared_ptr<std::vector<float>> splitPlanes;
+      // The positions of quantized pkds, relative to quantizationBounds.
+      // positions is only kept for these if we're refitting
+      std::shared_ptr<std::vector<uint64>> quantizedPositions;
+      box3f quantizationBounds;
+      // The attributes as 8 or 16 bit values normalized to the global attribute
+      // range, if we store compact attributes. attributes is only kept for these
+      // if we're refitting
+      std::shared_ptr<std::vector<uint8>> compactAttributes;
 
       Ref<PartiKDGeometry> pkd;
       void *ispc_pkd;
@@ -70,6 +88,51 @@ namespace ospray {
      */
     float poll_delay;
     vec3i grid;
+    /*! if set, refit the previous timestep's pkd trees instead of
+     * rebuilding them from scratch. The order particles arrive in for
+     * a block is used as their ID, so this works best with sims that
+     * send their particles in a consistent order
+     */
+    bool refit;
+    /*! number of particles per leaf bucket to build bucketed pkds with,
+     * 0 builds the classic pkd with one particle per node
+     */
+    int bucketSize;
+    /*! depth of the treelets to store classic pkds in, see
+     * TreeletLayout. 0 keeps the plain heap order
+     */
+    int treeletDepth;
+    /*! if set, store the positions of classic pkds quantized to 20 bits
+     * per coordinate relative to each block's ghost bounds, 8 instead
+     * of 12 bytes per particle
+     */
+    bool quantize;
+    /*! bits to store each particle's attribute in: 32 keeps floats, 16
+     * or 8 store them normalized to the global attribute range
+     */
+    int attributeBits;
+    /*! depth to cut each block's pkd at for Embree, see
+     * PartiKDGeometry::subtreeDepth. 0 gives Embree the whole block
+     */
+    int subtreeDepth;
+    /*! number of top levels of each block's pkd to store tight
+     * subtree bounds for, see PartiKDGeometry::nodeBounds
+     */
+    int boundsDepth;
+    /*! fraction of a packet's lanes below which the pkd traversal
+     * switches to per lane traversal, see PartiKDGeometry_set
+     */
+    float hybridThreshold;
+    /*! number of top levels of each block's pkd to store representative
+     * spheres for, and the angle in radians below which the traversal
+     * draws a subtree as its sphere, see PartiKDGeometry::lodNodes
+     */
+    int lodDepth;
+    float lodThreshold;
+    /*! if set, build a coarse occupancy grid of each block for the
+     * renderer to clip rays with, see DDSpheres::occupancy
+     */
+    bool occupancyGrid;
 
     // TODO: We need to store DDBlock's of particle data like the data-distrib
     // volume rendering code.
@@ -85,6 +148,8 @@ namespace ospray {
     std::atomic<bool> simPollerShouldExit;
     // The next set of particle data that we'll be switching too
     std::vector<DDSpheres> nextDDSpheres;
+    // The last set of particle data we built, kept around to refit from
+    std::vector<DDSpheres> prevDDSpheres;
     // Repeatedly poll from the simulation until poller_exit
     // is set true
     // Worker nodes should run this on a separate thread and call it repeatedly
@@ -93,8 +158,14 @@ namespace ospray {
     void pollSimulation();
     // Fetch new data from the simulation
     void getTimeStep();
-    // Build the PKD tree on the block of particles in the grid into the DDSpheres passed
-    void buildPKDBlock(const DomainGrid::Block &b, DDSpheres &ddspheres) const;
+    // Build the PKD tree on the block of particles in the grid into the DDSpheres passed,
+    // or refit the tree of the previous timestep's block if one is passed. Returns
+    // the number of nodes that were (re-)built
+    size_t buildPKDBlock(const DomainGrid::Block &b, DDSpheres &ddspheres,
+                         const DDSpheres *prev) const;
+    // Combine the tight bounds and occupancy of our blocks computed by
+    // buildPKDBlock over all workers, so every rank knows them for every block
+    void exchangeBlockBounds(std::vector<DDSpheres> &blocks) const;
   };
   /*! @} */
 
@@ -17,6 +17,15 @@
 #include "PKDGeometry.h"
 // ospray
 #include "ospray/common/Model.h"
+#include "ospray/common/tasking/parallel_for.h"
+// this module
+#include "apps/PartiKD.h"
+#include "apps/PKDFile.h"
+// std
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 // ispc exports
 #include "PKDGeometry_ispc.h"
 
@@ -26,25 +35,35 @@ namespace ospray {
 
   //! Constructor
   PartiKDGeometry::PartiKDGeometry()
-    : particleRadius(.02f)
+    : attribute(NULL), attributeBits(32),
+      particleRadius(.02f), bucketSize(0), splitPlane(NULL),
+      quantizationOrigin(0.f), quantizationScale(1.f),
+      mappedFile(NULL), mappedFileSize(0), subtreeDepth(0),
+      hasFinalizeCache(false), finalizeSubtreeDepth(0), finalizeBoundsDepth(0),
+      finalizeLODDepth(0)
   {
     ispcEquivalent = ispc::PartiKDGeometry_create(this);
   }
 
-    vec3f decodeParticle(size_t i) {
+    vec3f decodeParticle(size_t i, const vec3f &origin, const vec3f &scale) {
       size_t mask = (1<<20)-1;
       size_t ix = (i>> 2)&mask;
       size_t iy = (i>>22)&mask;
       size_t iz = (i>>42)&mask;
-      return vec3f(ix,iy,iz);
+      return origin + vec3f(ix,iy,iz)*scale;
     }
 
   
   vec3f PartiKDGeometry::getParticle(size_t i) const 
   {
+    if (bucketSize) {
+      const float *bucket = (const float*)particle + 3*bucketSize*(i/bucketSize);
+      const size_t lane = i % bucketSize;
+      return vec3f(bucket[lane],bucket[bucketSize+lane],bucket[2*bucketSize+lane]);
+    }
     switch(format) {
     case OSP_FLOAT3: return particle3f[i];
-    case OSP_ULONG: return decodeParticle(particle1ul[i]);
+    case OSP_ULONG: return decodeParticle(particle1ul[i],quantizationOrigin,quantizationScale);
     default: NOTIMPLEMENTED;
     };
   }
@@ -53,18 +72,39 @@ namespace ospray {
   /*! return bounding box of particle centers */
   box3f PartiKDGeometry::getBounds() const
   {
+    const size_t blockSize = 64*1024;
+    const size_t numBlocks = (numParticles+blockSize-1)/blockSize;
+    std::vector<box3f> blockBounds(numBlocks);
+    parallel_for(int(numBlocks), [&](int blockID) {
+      const size_t begin = blockID*blockSize;
+      const size_t end   = std::min(begin+blockSize,numParticles);
+      box3f b = empty;
+      for (size_t i=begin;i<end;i++)
+        b.extend(getParticle(i));
+      blockBounds[blockID] = b;
+    });
     box3f b = empty;
-    for (size_t i=0;i<numParticles;i++) {
-      b.extend(getParticle(i));
-    }
+    for (const box3f &blockBound : blockBounds)
+      b.extend(blockBound);
     return b;
   }
 
+  bool PartiKDGeometry::FinalizeKey::operator==(const FinalizeKey &other) const
+  {
+    return particleData.ptr == other.particleData.ptr && numParticles == other.numParticles
+      && bucketSize == other.bucketSize && treeletDepth == other.treeletDepth
+      && quantizationOrigin == other.quantizationOrigin
+      && quantizationScale == other.quantizationScale
+      && attributeData.ptr == other.attributeData.ptr && attributeBits == other.attributeBits
+      && hasRange == other.hasRange && attr_lo == other.attr_lo && attr_hi == other.attr_hi;
+  }
+
   uint32 getAttributeBits(float val, float lo, float hi)
   {
     // cout << " attrbits: " << val << " (" << lo << "," << hi << ")" << endl;
     if (hi == lo) return 1;
-    int bit = std::min((int)31,int(32*((val-lo)/float(hi-lo))));
+    // values outside of [lo,hi] get clamped like the transfer function does
+    int bit = std::max(0,std::min((int)31,int(32*((val-lo)/float(hi-lo)))));
     return 1<<bit;
   }
 
@@ -72,8 +112,326 @@ namespace ospray {
   void PartiKDGeometry::dependencyGotChanged(ManagedObject *object)
   {
     ispc::PartiKDGeometry_updateTransferFunction(this->getIE(),transferFunction->getIE());
+    updateOpacityMask();
+  }
+
+  void PartiKDGeometry::takeCullingStats(size_t &numNodesTested, size_t &numNodesCulled)
+  {
+    int64_t tested = 0, culled = 0;
+    ispc::PartiKDGeometry_takeCullingStats(getIE(),tested,culled);
+    numNodesTested = tested;
+    numNodesCulled = culled;
+  }
+
+  void PartiKDGeometry::takeLaneStats(bool occluded, LaneStats &stats)
+  {
+    int64_t packets = 0, spmdPackets = 0, stepLanes = 0, activeLanes = 0, switches = 0;
+    ispc::PartiKDGeometry_takeLaneStats(getIE(),occluded ? 1 : 0,
+                                        packets,spmdPackets,stepLanes,activeLanes,switches);
+    stats.numPackets      = packets;
+    stats.numSPMDPackets  = spmdPackets;
+    stats.numStepLanes    = stepLanes;
+    stats.numActiveLanes  = activeLanes;
+    stats.numSPMDSwitches = switches;
+  }
+
+  void PartiKDGeometry::updateOpacityMask()
+  {
+    // don't let the kernels read the bits while we recompute them
+    ispc::PartiKDGeometry_setOpacityMask(getIE(),NULL);
+    if (!attribute || !transferFunction) {
+      opacityMask.clear();
+      return;
+    }
+    const size_t numWords = (numParticles+31)/32;
+    opacityMask.resize(numWords);
+    const size_t wordsPerTask = 4*1024;
+    parallel_for(int((numWords+wordsPerTask-1)/wordsPerTask), [&](int taskID) {
+      const size_t begin = taskID*wordsPerTask;
+      const size_t end   = std::min(begin+wordsPerTask,numWords);
+      ispc::PartiKDGeometry_computeOpacityMask(getIE(),opacityMask.data(),begin,end);
+    });
+    ispc::PartiKDGeometry_setOpacityMask(getIE(),opacityMask.data());
+  }
+
+
+  void PartiKDGeometry::unmapContainer()
+  {
+    if (mappedFile)
+      munmap(mappedFile,mappedFileSize);
+    mappedFile = NULL;
+    mappedFileSize = 0;
+    mappedFileName = "";
+  }
+
+  void PartiKDGeometry::mapContainer(const std::string &fileName)
+  {
+    unmapContainer();
+    const int fd = open(fileName.c_str(),O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("#osp:pkd: could not open pkd container '"+fileName+"'");
+    struct stat st;
+    if (fstat(fd,&st) != 0 || size_t(st.st_size) < sizeof(PKDFileHeader)) {
+      close(fd);
+      throw std::runtime_error("#osp:pkd: '"+fileName+"' is not a pkd container");
+    }
+    void *mem = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if (mem == MAP_FAILED)
+      throw std::runtime_error("#osp:pkd: could not map pkd container '"+fileName+"'");
+    mappedFile = mem;
+    mappedFileSize = st.st_size;
+    mappedFileName = fileName;
+
+    char *base = (char*)mappedFile;
+    const PKDFileHeader &header = *(const PKDFileHeader*)base;
+    const PKDFileAttribute *attributeTable = (const PKDFileAttribute*)(base+sizeof(PKDFileHeader));
+    auto inFile = [&](uint64 ofs, uint64 size) {
+      return ofs <= mappedFileSize && size <= mappedFileSize-ofs;
+    };
+    if (!header.isValid())
+      throw std::runtime_error("#osp:pkd: '"+fileName+"' is not a pkd container");
+    if (header.version != PKD_FILE_VERSION)
+      throw std::runtime_error("#osp:pkd: unsupported pkd container version in '"+fileName+"'");
+    if (header.headerSize < sizeof(PKDFileHeader)+header.numAttributes*sizeof(PKDFileAttribute)
+        || !inFile(0,header.headerSize)
+        || !inFile(header.positionOfs,header.positionSize)
+        || !inFile(header.splitPlaneOfs,header.splitPlaneSize))
+      throw std::runtime_error("#osp:pkd: corrupt pkd container '"+fileName+"'");
+
+    const size_t n = header.numParticles;
+    char *position = base+header.positionOfs;
+    mappedBounds = box3f(vec3f(header.bounds[0],header.bounds[1],header.bounds[2]),
+                         vec3f(header.bounds[3],header.bounds[4],header.bounds[5]));
+    switch (header.positionFormat) {
+    case PKD_POSITION_FLOAT3:
+      if (header.positionSize != n*sizeof(vec3f))
+        throw std::runtime_error("#osp:pkd: corrupt pkd container '"+fileName+"'");
+      mappedPosition = new Data(n,OSP_FLOAT3,position,OSP_DATA_SHARED_BUFFER);
+      break;
+    case PKD_POSITION_QUANTIZED64:
+      if (header.positionSize != n*sizeof(uint64))
+        throw std::runtime_error("#osp:pkd: corrupt pkd container '"+fileName+"'");
+      if (header.quantizationBits != 20)
+        throw std::runtime_error("#osp:pkd: unsupported quantization in pkd container '"+fileName+"'");
+      mappedPosition = new Data(n,OSP_ULONG,position,OSP_DATA_SHARED_BUFFER);
+      findParam("quantizationLower",1)->set(vec3f(header.quantizationBounds[0],
+                                                  header.quantizationBounds[1],
+                                                  header.quantizationBounds[2]));
+      findParam("quantizationUpper",1)->set(vec3f(header.quantizationBounds[3],
+                                                  header.quantizationBounds[4],
+                                                  header.quantizationBounds[5]));
+      break;
+    case PKD_POSITION_BUCKETED_FLOAT: {
+      if (header.positionSize != 3*n*sizeof(float)
+          || header.splitPlaneSize != header.numInnerNodes*sizeof(float))
+        throw std::runtime_error("#osp:pkd: corrupt pkd container '"+fileName+"'");
+      mappedPosition = new Data(3*n,OSP_FLOAT,position,OSP_DATA_SHARED_BUFFER);
+      Data *splitPlaneData = new Data(header.numInnerNodes,OSP_FLOAT,
+                                      base+header.splitPlaneOfs,OSP_DATA_SHARED_BUFFER);
+      findParam("splitPlane",1)->set(splitPlaneData);
+    } break;
+    default:
+      throw std::runtime_error("#osp:pkd: unknown position format in pkd container '"+fileName+"'");
+    }
+    findParam("position",1)->set(mappedPosition.ptr);
+    findParam("bucketSize",1)->set(int(header.bucketSize));
+    findParam("treeletDepth",1)->set(int(header.treeletDepth));
+    if (!hasParam("radius"))
+      findParam("radius",1)->set(header.radius);
+
+    // attribute selected by name, or the first one in the file
+    const char *attributeName = getParamString("attributeName",NULL);
+    for (uint32 i=0;i<header.numAttributes;i++) {
+      const PKDFileAttribute &attr = attributeTable[i];
+      if (attributeName && strncmp(attr.name,attributeName,sizeof(attr.name)) != 0)
+        continue;
+      const OSPDataType type = attr.bits == 8 ? OSP_UCHAR : attr.bits == 16 ? OSP_USHORT : OSP_FLOAT;
+      if (!inFile(attr.ofs,attr.size) || attr.size != n*(attr.bits/8)
+          || (attr.bits != 8 && attr.bits != 16 && attr.bits != 32))
+        throw std::runtime_error("#osp:pkd: corrupt pkd container '"+fileName+"'");
+      Data *attributeData = new Data(n,type,base+attr.ofs,OSP_DATA_SHARED_BUFFER);
+      findParam("attribute",1)->set(attributeData);
+      if (!hasParam("attribute_low") || !hasParam("attribute_high")) {
+        findParam("attribute_low",1)->set(attr.lo);
+        findParam("attribute_high",1)->set(attr.hi);
+      }
+      break;
+    }
+    cout << "#osp:pkd: mapped pkd container '" << fileName << "' with "
+      << n << " particles" << endl;
+  }
+
+  box3f PartiKDGeometry::subtreeCenterBoundsOf(size_t rootID, size_t numInnerNodes,
+                                               const TreeletLayout &treelets) const
+  {
+    // leaves of a bucketed tree are whole buckets
+    const size_t numNodes = bucketSize ? 2*numInnerNodes+1 : numParticles;
+    box3f b = empty;
+    // the nodes of each level of a subtree are contiguous, starting
+    // at the leftmost descendant of its root
+    size_t count = 1;
+    for (size_t first=rootID;first<numNodes;first=2*first+1,count*=2) {
+      const size_t end = std::min(first+count,numNodes);
+      for (size_t nodeID=first;nodeID<end;nodeID++) {
+        if (!bucketSize) {
+          b.extend(getParticle(treelets.storageIndex(nodeID)));
+        } else if (nodeID >= numInnerNodes) {
+          const size_t begin = (nodeID-numInnerNodes)*bucketSize;
+          for (size_t j=begin;j<begin+bucketSize;j++)
+            b.extend(getParticle(j));
+        }
+      }
+    }
+    return b;
   }
 
+  void PartiKDGeometry::computeSubtreeBounds(int depth, size_t numInnerNodes,
+                                             const TreeletLayout &treelets)
+  {
+    const size_t numNodes = bucketSize ? 2*numInnerNodes+1 : numParticles;
+    while (depth > 0 && (size_t(1)<<depth)-1 >= numNodes)
+      --depth;
+    subtreeDepth = std::max(depth,0);
+    subtreeCenterBounds.clear();
+    if (subtreeDepth == 0)
+      return;
+
+    const size_t firstRoot = (size_t(1)<<subtreeDepth)-1;
+    subtreeCenterBounds.resize(std::min(firstRoot+1,numNodes-firstRoot));
+    parallel_for(int(subtreeCenterBounds.size()), [&](int i) {
+      subtreeCenterBounds[i] = subtreeCenterBoundsOf(firstRoot+i,numInnerNodes,treelets);
+    });
+  }
+
+  void PartiKDGeometry::computeNodeBounds(int depth, size_t numInnerNodes,
+                                          const TreeletLayout &treelets)
+  {
+    const size_t numNodes = bucketSize ? 2*numInnerNodes+1 : numParticles;
+    nodeBounds.resize(std::min((size_t(1)<<std::max(depth,0))-1,numNodes));
+    if (nodeBounds.empty())
+      return;
+
+    // walk the subtrees of the deepest level we keep, then build the
+    // levels above from their children, one level at a time
+    int level = 63-__builtin_clzll(nodeBounds.size());
+    size_t begin = (size_t(1)<<level)-1;
+    parallel_for(int(nodeBounds.size()-begin), [&](int i) {
+      nodeBounds[begin+i] = subtreeCenterBoundsOf(begin+i,numInnerNodes,treelets);
+    });
+    while (--level >= 0) {
+      begin = (size_t(1)<<level)-1;
+      parallel_for(int(begin+1), [&](int i) {
+        const size_t nodeID = begin+i;
+        box3f b = empty;
+        if (!bucketSize)
+          b.extend(getParticle(treelets.storageIndex(nodeID)));
+        for (size_t childID=2*nodeID+1;childID<=2*nodeID+2;childID++) {
+          if (childID < nodeBounds.size()) {
+            b.extend(nodeBounds[childID]);
+          } else if (childID < numNodes) {
+            b.extend(subtreeCenterBoundsOf(childID,numInnerNodes,treelets));
+          }
+        }
+        nodeBounds[nodeID] = b;
+      });
+    }
+  }
+
+  void PartiKDGeometry::computeLODSubtrees(int depth, size_t numInnerNodes,
+                                           const TreeletLayout &treelets,
+                                           float attr_lo, float attr_hi)
+  {
+    // proxies of bucketed trees aren't supported by their kernels
+    lodSubtrees.resize(bucketSize ? 0 : std::min((size_t(1)<<std::max(depth,0))-1,numInnerNodes));
+    if (lodSubtrees.empty())
+      return;
+
+    // the attribute normalized like the kernels do, see
+    // pkdNormalizedAttribute
+    auto attributeOf = [&](size_t i) {
+      if (!attribute)
+        return 0.f;
+      switch (attributeBits) {
+      case 8:  return ((const uint8*)attribute)[i]*(1.f/255.f);
+      case 16: return ((const uint16*)attribute)[i]*(1.f/65535.f);
+      default: return attr_hi > attr_lo
+          ? (((const float*)attribute)[i]-attr_lo)/(attr_hi-attr_lo) : 0.f;
+      }
+    };
+    // sums over the particles of a subtree
+    struct Aggregate {
+      size_t count;
+      double sum[3];
+      double attribute;
+      box3f  bounds;
+      Aggregate() : count(0), attribute(0), bounds(empty)
+      { sum[0] = sum[1] = sum[2] = 0; }
+      void add(const vec3f &pos, float attrib)
+      {
+        ++count;
+        sum[0] += pos.x; sum[1] += pos.y; sum[2] += pos.z;
+        attribute += attrib;
+        bounds.extend(pos);
+      }
+      void add(const Aggregate &other)
+      {
+        count += other.count;
+        for (int i=0;i<3;i++)
+          sum[i] += other.sum[i];
+        attribute += other.attribute;
+        bounds.extend(other.bounds);
+      }
+    };
+    auto particleOf = [&](Aggregate &a, size_t nodeID) {
+      const size_t storeID = treelets.storageIndex(nodeID);
+      a.add(getParticle(storeID),attributeOf(storeID));
+    };
+    auto subtreeOf = [&](size_t rootID) {
+      Aggregate a;
+      size_t count = 1;
+      for (size_t first=rootID;first<numParticles;first=2*first+1,count*=2) {
+        const size_t end = std::min(first+count,numParticles);
+        for (size_t nodeID=first;nodeID<end;nodeID++)
+          particleOf(a,nodeID);
+      }
+      return a;
+    };
+
+    // same order as computeNodeBounds: the subtrees of the deepest
+    // level we keep, then the levels above from their children
+    std::vector<Aggregate> aggregate(lodSubtrees.size());
+    int level = 63-__builtin_clzll(lodSubtrees.size());
+    size_t begin = (size_t(1)<<level)-1;
+    parallel_for(int(lodSubtrees.size()-begin), [&](int i) {
+      aggregate[begin+i] = subtreeOf(begin+i);
+    });
+    while (--level >= 0) {
+      begin = (size_t(1)<<level)-1;
+      parallel_for(int(begin+1), [&](int i) {
+        const size_t nodeID = begin+i;
+        Aggregate a;
+        particleOf(a,nodeID);
+        for (size_t childID=2*nodeID+1;childID<=2*nodeID+2;childID++) {
+          if (childID < aggregate.size()) {
+            a.add(aggregate[childID]);
+          } else if (childID < numParticles) {
+            a.add(subtreeOf(childID));
+          }
+        }
+        aggregate[nodeID] = a;
+      });
+    }
+
+    parallel_for(int(lodSubtrees.size()), [&](int i) {
+      const Aggregate &a = aggregate[i];
+      LODSubtree &sub = lodSubtrees[i];
+      sub.center = vec3f(a.sum[0]/a.count,a.sum[1]/a.count,a.sum[2]/a.count);
+      sub.reach = length(max(a.bounds.upper-sub.center,sub.center-a.bounds.lower));
+      sub.attribute = float(a.attribute/a.count);
+      sub.count = a.count;
+    });
+  }
 
   /*! \brief integrates this geometry's primitives into the respective
     model's acceleration structure */
@@ -84,8 +442,13 @@ namespace ospray {
     //
     // note:
     // - "float radius" *MUST* be defined with the object
-    // - "data<vec3f> particles' *MUST* be defined for the object
+    // - "data<vec3f> particles' *MUST* be defined for the object,
+    //   unless they come from a pkd container passed as "fileName"
     // -------------------------------------------------------
+    const char *fileName = getParamString("fileName",NULL);
+    if (fileName && mappedFileName != fileName)
+      mapContainer(fileName);
+
     particleData = getParamData("position");
     if (!particleData)
       throw std::runtime_error("#osp:pkd: no 'position' data found with object");
@@ -94,15 +457,88 @@ namespace ospray {
     numParticles = particleData->numItems;
     format = particleData->type;
     bool isQuantized = format == OSP_ULONG;
-    const box3f centerBounds = getBounds();
+    size_t numInnerNodes = numParticles/2;
+    if (isQuantized) {
+      // dequantize to the cell centers of the bounds the particles were
+      // quantized in, see PartiKD::quantizedPositions
+      if (hasParam("quantizationLower") && hasParam("quantizationUpper")) {
+        const vec3f lower = getParam3f("quantizationLower",vec3f(0.f));
+        const vec3f upper = getParam3f("quantizationUpper",vec3f(0.f));
+        quantizationScale  = (upper-lower)*(1.f/(1<<20));
+        quantizationOrigin = lower+.5f*quantizationScale;
+      } else {
+        cout << "#osp:pkd: Warning - no quantization bounds given, "
+          "rendering quantized particles in grid coordinates" << endl;
+        quantizationOrigin = vec3f(0.f);
+        quantizationScale  = vec3f(1.f);
+      }
+    }
+
+    bucketSize = getParam1i("bucketSize",0);
+    if (bucketSize) {
+      splitPlaneData = getParamData("splitPlane");
+      if (!splitPlaneData)
+        throw std::runtime_error("#osp:pkd: no 'splitPlane' data found with bucketed object");
+      if (format != OSP_FLOAT)
+        throw std::runtime_error("#osp:pkd: bucketed trees need their positions as 'float' data");
+      splitPlane    = (float*)splitPlaneData->data;
+      numParticles  = particleData->numItems/3;
+      numInnerNodes = splitPlaneData->numItems;
+      if (numParticles != (numInnerNodes+1)*bucketSize)
+        throw std::runtime_error("#osp:pkd: number of split planes doesn't match number of buckets");
+    }
+
+    // classic trees can be stored in treelet order, see TreeletLayout
+    const int treeletDepth = getParam1i("treeletDepth",0);
+    if (treeletDepth && bucketSize)
+      throw std::runtime_error("#osp:pkd: treelet order is not supported for bucketed trees");
+    const TreeletLayout treelets(numParticles,treeletDepth);
     
     attributeData = getParamData("attribute",NULL);
+    attribute = attributeData ? attributeData->data : NULL;
+    attributeBits = 32;
+    if (attributeData) {
+      switch (attributeData->type) {
+      case OSP_FLOAT:  attributeBits = 32; break;
+      case OSP_USHORT: attributeBits = 16; break;
+      case OSP_UCHAR:  attributeBits = 8;  break;
+      default:
+        throw std::runtime_error("#osp:pkd: 'attribute' data must be float, ushort or uchar");
+      }
+    }
+
+    // the center bounds and attribute masks only depend on the data,
+    // so re-finalizing with the same data (e.g. for a new transfer
+    // function) can reuse them
+    FinalizeKey key;
+    key.particleData       = particleData;
+    key.numParticles       = numParticles;
+    key.bucketSize         = bucketSize;
+    key.treeletDepth       = treeletDepth;
+    key.quantizationOrigin = isQuantized ? quantizationOrigin : vec3f(0.f);
+    key.quantizationScale  = isQuantized ? quantizationScale : vec3f(0.f);
+    key.attributeData      = attributeData;
+    key.attributeBits      = attributeBits;
+    key.hasRange           = hasParam("attribute_low") && hasParam("attribute_high");
+    key.attr_lo            = key.hasRange ? getParam1f("attribute_low", 0.f) : 0.f;
+    key.attr_hi            = key.hasRange ? getParam1f("attribute_high", 0.f) : 0.f;
+    const bool cached = hasFinalizeCache && key == finalizeKey;
+    finalizeKey = key;
+    hasFinalizeCache = true;
+
+    if (!cached) {
+      cachedCenterBounds
+        = (mappedFile && particleData.ptr == mappedPosition.ptr) ? mappedBounds : getBounds();
+    }
+    const box3f centerBounds = cachedCenterBounds;
+
     transferFunction = (TransferFunction*)getParamObject("transferFunction",NULL);
     if (transferFunction) {
       transferFunction->registerListener(this);
     }
 
     bool useSPMD = getParam1i("useSPMD",0);
+    float hybridThreshold = getParam1f("hybridThreshold",.5f);
 
     particleRadius = getParamf("radius",0.f);
     if (particleRadius <= 0.f)
@@ -114,59 +550,177 @@ namespace ospray {
     
     const box3f sphereBounds(centerBounds.lower - vec3f(particleRadius),
                              centerBounds.upper + vec3f(particleRadius));
-    size_t numInnerNodes = numParticles/2;
 
 
     // compute attribute mask and attrib lo/hi values
-    float attr_lo = 0.f, attr_hi = 0.f;
-    uint32 *binBitsArray = NULL;
-    attribute = (float*)(attributeData?attributeData->data:NULL);
-
-    // Attribute culling on the lidar type-punned RGB data doesn't make sense, so don't do it
-    if (attribute) {
-      if (hasParam("attribute_low") && hasParam("attribute_high")) {
-        attr_lo = getParam1f("attribute_low", 0.f);
-        attr_hi = getParam1f("attribute_high", 0.f);
+    if (cached) {
+      // nothing to do, the mask and range are still valid
+    } else if (!attribute) {
+      cachedAttrLo = cachedAttrHi = 0.f;
+      innerNodeAttributeMask.clear();
+    } else {
+      // Attribute culling on the lidar type-punned RGB data doesn't make sense, so don't do it
+      float attr_lo = 0.f, attr_hi = 0.f;
+      if (key.hasRange) {
+        attr_lo = key.attr_lo;
+        attr_hi = key.attr_hi;
+      } else if (attributeBits < 32) {
+        // compact attributes are stored normalized to their range already
+        attr_lo = 0.f;
+        attr_hi = 1.f;
       } else {
-        attr_lo = attr_hi = attribute[0];
-        for (size_t i=0;i<numParticles;i++){
-          attr_lo = std::min(attr_lo,attribute[i]);
-          attr_hi = std::max(attr_hi,attribute[i]);
+        const float *value = (const float*)attribute;
+        const size_t blockSize = 64*1024;
+        const size_t numBlocks = (numParticles+blockSize-1)/blockSize;
+        std::vector<vec2f> blockRange(numBlocks);
+        parallel_for(int(numBlocks), [&](int blockID) {
+          const size_t begin = blockID*blockSize;
+          const size_t end   = std::min(begin+blockSize,numParticles);
+          vec2f range(value[begin]);
+          for (size_t i=begin;i<end;i++) {
+            range.x = std::min(range.x,value[i]);
+            range.y = std::max(range.y,value[i]);
+          }
+          blockRange[blockID] = range;
+        });
+        attr_lo = attr_hi = value[0];
+        for (const vec2f &range : blockRange) {
+          attr_lo = std::min(attr_lo,range.x);
+          attr_hi = std::max(attr_hi,range.y);
         }
       }
+      cachedAttrLo = attr_lo;
+      cachedAttrHi = attr_hi;
+      // culling bits of the attribute stored at i, binned like the
+      // kernels normalize it, see pkdNormalizedAttribute
+      auto attributeBitsOf = [&](size_t i) {
+        switch (attributeBits) {
+        case 8:  return getAttributeBits(((const uint8*)attribute)[i]*(1.f/255.f),0.f,1.f);
+        case 16: return getAttributeBits(((const uint16*)attribute)[i]*(1.f/65535.f),0.f,1.f);
+        default: return getAttributeBits(((const float*)attribute)[i],attr_lo,attr_hi);
+        }
+      };
+
+      // leaf nodes of a bucketed tree are whole buckets
+      const size_t numNodes = bucketSize ? 2*numInnerNodes+1 : numParticles;
+      auto leafBits = [&](size_t nodeID) {
+        if (!bucketSize)
+          return attributeBitsOf(treelets.storageIndex(nodeID));
+        uint32 bits = 0;
+        const size_t begin = (nodeID-numInnerNodes)*bucketSize;
+        for (size_t i=begin;i<begin+bucketSize;i++)
+          bits |= attributeBitsOf(i);
+        return bits;
+      };
 
-      binBitsArray = new uint32[numInnerNodes];
-      size_t numBytesRangeTree = numInnerNodes * sizeof(uint32);
-      for (long long pID=numInnerNodes-1;pID>=0;--pID) {
-        size_t lID = 2*pID+1;
-        size_t rID = lID+1;
-        uint32 lBits = 0, rBits = 0;
+      // a node's bits cover its own particle (inner nodes of bucketed
+      // trees have none) and both subtrees
+      innerNodeAttributeMask.resize(numInnerNodes);
+      uint32 *const binBits = innerNodeAttributeMask.data();
+      auto innerBits = [&](size_t pID) {
+        const size_t lID = 2*pID+1;
+        const size_t rID = lID+1;
+        uint32 bits = bucketSize ? 0 : attributeBitsOf(treelets.storageIndex(pID));
         if (rID < numInnerNodes)
-          rBits = binBitsArray[rID];
-        else if (rID < numParticles)
-          rBits = getAttributeBits(attribute[rID],attr_lo,attr_hi);
+          bits |= binBits[rID];
+        else if (rID < numNodes)
+          bits |= leafBits(rID);
         if (lID < numInnerNodes)
-          lBits = binBitsArray[lID];
-        else if (lID < numParticles)
-          lBits = getAttributeBits(attribute[lID],attr_lo,attr_hi);
-        binBitsArray[pID] = lBits|rBits;
+          bits |= binBits[lID];
+        else if (lID < numNodes)
+          bits |= leafBits(lID);
+        binBits[pID] = bits;
+      };
+      // build bottom up one level at a time, each level in parallel
+      const size_t nodesPerTask = 16*1024;
+      for (int level=63-__builtin_clzll(numInnerNodes|1);level>=0;--level) {
+        const size_t begin = (size_t(1)<<level)-1;
+        const size_t end   = std::min((size_t(2)<<level)-1,numInnerNodes);
+        if (begin >= end) continue;
+        parallel_for(int((end-begin+nodesPerTask-1)/nodesPerTask), [&](int taskID) {
+          const size_t taskBegin = begin+taskID*nodesPerTask;
+          const size_t taskEnd   = std::min(taskBegin+nodesPerTask,end);
+          for (size_t pID=taskBegin;pID<taskEnd;pID++)
+            innerBits(pID);
+        });
       }
-      cout << "#osp:pkd: found attribute [" << attr_lo << ".."
-        << attr_hi << "], root bits " << (int*)(int64)binBitsArray[0] << endl;
+      if (numInnerNodes > 0)
+        cout << "#osp:pkd: found attribute [" << attr_lo << ".."
+          << attr_hi << "], root bits " << (int*)(int64)binBits[0] << endl;
+    }
+    const float attr_lo = cachedAttrLo, attr_hi = cachedAttrHi;
+
+    // optionally cut the tree into subtrees, for Embree to cull
+    const int requestedSubtreeDepth = getParam1i("subtreeDepth",0);
+    if (!cached || requestedSubtreeDepth != finalizeSubtreeDepth) {
+      computeSubtreeBounds(requestedSubtreeDepth,numInnerNodes,treelets);
+      finalizeSubtreeDepth = requestedSubtreeDepth;
+    }
+    subtreeBounds.resize(subtreeCenterBounds.size());
+    for (size_t i=0;i<subtreeBounds.size();i++)
+      subtreeBounds[i] = box3f(subtreeCenterBounds[i].lower - vec3f(particleRadius),
+                               subtreeCenterBounds[i].upper + vec3f(particleRadius));
+    if (subtreeDepth > 0)
+      cout << "#osp:pkd: cut tree at depth " << subtreeDepth << " into "
+        << subtreeBounds.size() << " subtrees" << endl;
+
+    // tight bounds of the top nodes' subtrees, to skip their empty space
+    const int boundsDepth = getParam1i("boundsDepth",0);
+    if (!cached || boundsDepth != finalizeBoundsDepth) {
+      computeNodeBounds(boundsDepth,numInnerNodes,treelets);
+      finalizeBoundsDepth = boundsDepth;
+    }
+
+    // representative spheres of the top nodes' subtrees, drawn instead
+    // of them once they're small enough on screen
+    const int lodDepth = getParam1i("lodDepth",0);
+    const float lodThreshold = getParam1f("lodThreshold",0.f);
+    if (!cached || lodDepth != finalizeLODDepth) {
+      computeLODSubtrees(lodDepth,numInnerNodes,treelets,attr_lo,attr_hi);
+      finalizeLODDepth = lodDepth;
+    }
+    // the proxy grows with the particles' volume, but never beyond
+    // what they span
+    lodNodes.resize(lodSubtrees.size());
+    for (size_t i=0;i<lodNodes.size();i++) {
+      const LODSubtree &sub = lodSubtrees[i];
+      LODNode &lod = lodNodes[i];
+      lod.center = sub.center;
+      lod.extent = sub.reach + particleRadius;
+      lod.radius = std::min(powf(float(sub.count),1.f/3.f)*particleRadius,lod.extent);
+      lod.attribute = sub.attribute;
     }
+    const size_t numLODNodes = lodThreshold > 0.f ? lodNodes.size() : 0;
 
     // -------------------------------------------------------
     // actually create the ISPC-side geometry now
     // -------------------------------------------------------
-    ispc::PartiKDGeometry_set(getIE(),model->getIE(),isQuantized,useSPMD,
+    ispc::PartiKDGeometry_set(getIE(),model->getIE(),isQuantized,useSPMD,hybridThreshold,
                               transferFunction?transferFunction->getIE():NULL,
                               particleRadius,
                               numParticles,
                               numInnerNodes,
                               (ispc::PKDParticle*)particle,
-                              attribute,binBitsArray,
+                              attribute,attributeBits,
+                              innerNodeAttributeMask.empty() ? NULL : innerNodeAttributeMask.data(),
                               (ispc::box3f&)sphereBounds,
-                              attr_lo,attr_hi);
+                              attr_lo,attr_hi,
+                              bucketSize,splitPlane,
+                              treelets.depth,
+                              treelets.lastBandBegin,treelets.lastBandLevels,
+                              treelets.numFullLast,treelets.lastPartialSize,
+                              (ispc::vec3f&)quantizationOrigin,
+                              (ispc::vec3f&)quantizationScale,
+                              subtreeDepth,subtreeBounds.size(),
+                              subtreeBounds.empty() ? NULL : (ispc::box3f*)subtreeBounds.data(),
+                              nodeBounds.size(),
+                              nodeBounds.empty() ? NULL : (ispc::box3f*)nodeBounds.data(),
+                              numLODNodes,
+                              numLODNodes == 0 ? NULL : (ispc::PKDLODNode*)lodNodes.data(),
+                              lodThreshold);
+    if (transferFunction)
+      ispc::PartiKDGeometry_updateTransferFunction(getIE(),transferFunction->getIE());
+    updateOpacityMask();
   }    
 
   OSP_REGISTER_GEOMETRY(PartiKDGeometry,pkd_geometry);
@@ -22,6 +22,8 @@
 
 namespace ospray {
 
+  struct TreeletLayout;
+
   /*! the actual ospray geometry for a PartiKD */
   struct PartiKDGeometry : public ospray::Geometry {
     //! Constructor
@@ -33,6 +35,10 @@ namespace ospray {
       if (attributeData.ptr) {
         attributeData->refDec();
       }
+      if (splitPlaneData.ptr) {
+        splitPlaneData->refDec();
+      }
+      unmapContainer();
     }
 
     //! \brief common function to help printf-debugging 
@@ -49,12 +55,65 @@ namespace ospray {
     /*! gets called whenever any of this node's dependencies got changed */
     virtual void dependencyGotChanged(ManagedObject *object);
 
+    /*! map the pkd container 'fileName' (see PKDFileHeader), and set
+        its columns as this geometry's 'position', 'attribute' (etc)
+        data, used in place */
+    void mapContainer(const std::string &fileName);
+    void unmapContainer();
+
+    /*! recompute the per-particle opacity bits for the current
+        transfer function, see opacityMask */
+    void updateOpacityMask();
+    /*! number of inner nodes the traversal tested for attribute
+        culling, and culled, since the last call. only counted with
+        PKD_CULLING_STATS */
+    void takeCullingStats(size_t &numNodesTested, size_t &numNodesCulled);
+    //! lane utilization counts of the hybrid packet traversal
+    struct LaneStats {
+      //! packets traced, and how many of them went per lane right away
+      size_t numPackets, numSPMDPackets;
+      //! lanes of all packet traversal steps, and how many were active
+      size_t numStepLanes, numActiveLanes;
+      //! subtrees handed to the SPMD kernels during packet traversal
+      size_t numSPMDSwitches;
+    };
+    /*! lane utilization counts of the intersect (or 'occluded')
+        kernels since the last call. only counted with PKD_LANE_STATS */
+    void takeLaneStats(bool occluded, LaneStats &stats);
+    /*! compute subtreeCenterBounds for the tree cut at 'depth' (or
+        less, if the tree isn't that deep), and set subtreeDepth */
+    void computeSubtreeBounds(int depth, size_t numInnerNodes,
+                              const TreeletLayout &treelets);
+    //! compute nodeBounds for the nodes of the top 'depth' levels
+    void computeNodeBounds(int depth, size_t numInnerNodes,
+                           const TreeletLayout &treelets);
+    /*! compute lodSubtrees for the nodes of the top 'depth' levels of
+        a classic tree, with the attribute normalized to [attr_lo,attr_hi] */
+    void computeLODSubtrees(int depth, size_t numInnerNodes,
+                            const TreeletLayout &treelets,
+                            float attr_lo, float attr_hi);
+    //! bounds of the particle centers in the subtree of node 'rootID'
+    box3f subtreeCenterBoundsOf(size_t rootID, size_t numInnerNodes,
+                                const TreeletLayout &treelets) const;
+
     //! transfer function for color/alpha mapping, may be NULL
     Ref<TransferFunction> transferFunction;
     Ref<Data> particleData;
     Ref<Data> attributeData;
+    Ref<Data> splitPlaneData;
 
-    float    *attribute;
+    void     *attribute;
+    /*! bits per attribute value: 32 for float attributes, 16 (ushort)
+        or 8 (uchar) for compact ones, which store the attribute
+        normalized to its range (see compactAttribute) */
+    int       attributeBits;
+    /*! one bit per particle, set if the transfer function maps its
+        attribute to a hittable opacity; empty if there's no attribute
+        or transfer function */
+    std::vector<uint32> opacityMask;
+    /*! one bit mask per inner node of the attribute bins present in
+        its subtree, see getAttributeBits */
+    std::vector<uint32> innerNodeAttributeMask;
     OSPDataType format; //!< format of the particles: float3, or uint64
     union {
       void     *particle;
@@ -63,6 +122,102 @@ namespace ospray {
     };
     size_t    numParticles;
     float     particleRadius;
+    /*! number of particles per leaf bucket, 0 for the classic layout
+        with one particle per node. bucketed trees store their
+        particles as x[],y[],z[] per bucket, and their inner nodes as
+        split planes */
+    size_t    bucketSize;
+    float    *splitPlane;
+    /*! @{ quantized particles store 20-bit grid coordinates i, at
+        quantizationOrigin+i*quantizationScale */
+    vec3f     quantizationOrigin;
+    vec3f     quantizationScale;
+    /*! @} */
+
+    //! the mapped container, if the particles come from a "fileName"
+    void     *mappedFile;
+    size_t    mappedFileSize;
+    std::string mappedFileName;
+    Ref<Data> mappedPosition;
+    /*! bounds of the mapped particle centers as stored in the
+        container, so we don't have to touch all pages to get them */
+    box3f     mappedBounds;
+
+    /*! depth the tree is cut at for Embree (the "subtreeDepth"
+        parameter), 0 to give Embree the whole tree as a single
+        primitive. otherwise each subtree rooted at that depth is a
+        primitive with tight bounds, and so is each particle above
+        it, so Embree can cull the empty parts of a block */
+    int       subtreeDepth;
+    //! bounds of the particle centers of each subtree
+    std::vector<box3f> subtreeCenterBounds;
+    //! the same, grown by the particle radius, as used by the kernels
+    std::vector<box3f> subtreeBounds;
+    /*! bounds of the particle centers in the subtree of each node of
+        the top "boundsDepth" levels, by heap index. the traversal
+        clips the ray to them, so it skips the empty space of
+        clustered data the split planes alone can't */
+    std::vector<box3f> nodeBounds;
+    //! what the LODNode of a subtree is made from, without the particle radius
+    struct LODSubtree {
+      //! centroid of the particle centers
+      vec3f  center;
+      //! distance from the center that bounds all particle centers
+      float  reach;
+      //! mean normalized attribute value, 0 without attribute
+      float  attribute;
+      //! number of particles in the subtree
+      size_t count;
+    };
+    //! LODSubtree of each node of lodNodes
+    std::vector<LODSubtree> lodSubtrees;
+    /*! representative sphere of the particles in a subtree, for the
+        level-of-detail traversal. same layout as the ISPC side's
+        PKDLODNode */
+    struct LODNode {
+      //! centroid of the particle centers
+      vec3f center;
+      //! radius of the proxy sphere drawn for the subtree
+      float radius;
+      //! distance from the center that bounds all particles
+      float extent;
+      //! mean normalized attribute value, 0 without attribute
+      float attribute;
+    };
+    /*! LODNode of the subtree of each node of the top "lodDepth"
+        levels of a classic tree, by heap index. the closest hit
+        traversal draws a subtree as its proxy once its extent covers
+        less than "lodThreshold" radians */
+    std::vector<LODNode> lodNodes;
+
+    /*! what the cached center bounds, attribute range and
+        innerNodeAttributeMask were computed from in the last
+        finalize. Data is assumed not to change its contents, so
+        finalizing again with the same arrays and parameters (e.g.
+        for a new transfer function) skips recomputing them. the key
+        holds on to the Data, so a new one can't reuse its address */
+    struct FinalizeKey {
+      Ref<Data>   particleData;
+      size_t      numParticles;
+      size_t      bucketSize;
+      int         treeletDepth;
+      vec3f       quantizationOrigin, quantizationScale;
+      Ref<Data>   attributeData;
+      int         attributeBits;
+      bool        hasRange;
+      float       attr_lo, attr_hi;
+      bool operator==(const FinalizeKey &other) const;
+    };
+    FinalizeKey finalizeKey;
+    bool        hasFinalizeCache;
+    box3f       cachedCenterBounds;
+    float       cachedAttrLo, cachedAttrHi;
+    //! the "subtreeDepth" subtreeCenterBounds were computed for
+    int         finalizeSubtreeDepth;
+    //! the "boundsDepth" nodeBounds were computed for
+    int         finalizeBoundsDepth;
+    //! the "lodDepth" lodSubtrees were computed for
+    int         finalizeLODDepth;
   };
   uint32 getAttributeBits(float val, float lo, float hi);
   
@@ -0,0 +1,68 @@
+#!/bin/bash
+#SBATCH -J pkd-bounds
+#SBATCH -t 01:00:00
+# 1 osp master + 1 osp worker + 2 test_sim
+#SBATCH -N 4
+#SBATCH -n 4
+#SBATCH -p normal
+
+# Compares rendering a single big pkd block with and without tight bounds
+# for the top levels of the tree (PKD_BOUNDS_DEPTH), on uniformly
+# distributed and on clustered particles. All particles of the test sim go
+# to the single ospray worker.
+
+WORK=/work/03160/will/
+LONESTAR=$WORK/lonestar
+WORK_DIR=$LONESTAR/ospray/build/stamp_knl/
+OUT_DIR=`pwd`
+# Make sure Embree environment vars are setup
+source $LONESTAR/embree-2.10.0.x86_64.linux/embree-vars.sh
+
+MODULE_ISP=$LONESTAR/ospray/modules/module_in_situ_particles/
+BENCH_SCRIPT=$MODULE_ISP/bench_insituspheres.chai
+TEST_SIMULATION=$MODULE_ISP/libIS/build/test_sim
+
+BOUNDS_DEPTHS=(0 6 10)
+# clusters per sim rank, 0 distributes the particles uniformly
+NUM_CLUSTERS=(0 8)
+NUM_SIM_NODES=2
+SIM_RANKS_PER_NODE=16
+SIM_RANKS=$(($NUM_SIM_NODES * $SIM_RANKS_PER_NODE))
+PARTICLES_PER_SIM_RANK=1000000
+
+export OSPRAY_DATA_PARALLEL=1x1x1
+
+start_osp_nodes=$(($NUM_SIM_NODES + 1))
+OSPRAY_NODE_LIST=`scontrol show hostname $SLURM_NODELIST | tail -n +${start_osp_nodes} | tr '\n' ',' | sed s/,$//`
+SIM_NODE_LIST=`scontrol show hostname $SLURM_NODELIST | head -n ${NUM_SIM_NODES} | tr '\n' ',' | sed s/,$//`
+
+echo "Sim using $SIM_NODE_LIST"
+echo "OSPRay using $OSPRAY_NODE_LIST"
+
+export SIMULATION_HEAD_NODE=`scontrol show hostname $SLURM_NODELIST | head -n 1`
+export I_MPI_PIN_DOMAIN=node
+
+cd $WORK_DIR
+set -x
+
+for clusters in ${NUM_CLUSTERS[*]}; do
+  for depth in ${BOUNDS_DEPTHS[*]}; do
+    export PKD_BOUNDS_DEPTH=$depth
+    RUN_NAME=${SLURM_JOB_NAME}-clusters${clusters}-bounds${depth}
+
+    echo "Spawning simulation with $clusters clusters per rank"
+    mpiexec.hydra -n $SIM_RANKS -ppn $SIM_RANKS_PER_NODE -hosts $SIM_NODE_LIST $TEST_SIMULATION \
+      $PARTICLES_PER_SIM_RANK $clusters > $OUT_DIR/${RUN_NAME}-sim-log.txt &
+    SIM_PID=$!
+
+    sleep 30
+
+    echo "Launching ospBenchmark with bounds depth $depth"
+    mpiexec.hydra -n 2 -ppn 1 -hosts $OSPRAY_NODE_LIST \
+      ./ospBenchmark --module pkd --osp:mpi --script $BENCH_SCRIPT -w 1920 -h 1080 \
+      | tee $OUT_DIR/${RUN_NAME}-ospray-log.txt
+
+    kill $SIM_PID
+    wait $SIM_PID
+  done
+done
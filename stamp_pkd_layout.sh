@@ -0,0 +1,87 @@
+#!/bin/bash
+#SBATCH -J pkd-layout
+#SBATCH -t 01:00:00
+# 1 osp master + 1 osp worker + 2 test_sim
+#SBATCH -N 4
+#SBATCH -n 4
+#SBATCH -p normal
+
+# Compares the dTLB and cache misses and the frame times of rendering a
+# single big pkd block stored in heap order (treelet depth 0) against the
+# treelet orders and the leaf-bucketed layouts (bucket size 8-32).
+# All particles of the test sim go to the single ospray worker, so
+# PARTICLES_PER_SIM_RANK * SIM_RANKS should be 100M+
+
+WORK=/work/03160/will/
+LONESTAR=$WORK/lonestar
+WORK_DIR=$LONESTAR/ospray/build/stamp_knl/
+OUT_DIR=`pwd`
+# Make sure Embree environment vars are setup
+source $LONESTAR/embree-2.10.0.x86_64.linux/embree-vars.sh
+
+MODULE_ISP=$LONESTAR/ospray/modules/module_in_situ_particles/
+BENCH_SCRIPT=$MODULE_ISP/bench_insituspheres.chai
+TEST_SIMULATION=$MODULE_ISP/libIS/build/test_sim
+
+TREELET_DEPTHS=(0 4 6 8)
+BUCKET_SIZES=(8 16 32)
+LAYOUTS=()
+for depth in ${TREELET_DEPTHS[*]}; do
+  LAYOUTS+=(treelet${depth})
+done
+for size in ${BUCKET_SIZES[*]}; do
+  LAYOUTS+=(bucket${size})
+done
+NUM_SIM_NODES=2
+SIM_RANKS_PER_NODE=16
+SIM_RANKS=$(($NUM_SIM_NODES * $SIM_RANKS_PER_NODE))
+PARTICLES_PER_SIM_RANK=4000000
+PERF_EVENTS=dTLB-loads,dTLB-load-misses,LLC-loads,LLC-load-misses,cache-references,cache-misses
+
+export OSPRAY_DATA_PARALLEL=1x1x1
+
+start_osp_nodes=$(($NUM_SIM_NODES + 1))
+OSPRAY_NODE_LIST=`scontrol show hostname $SLURM_NODELIST | tail -n +${start_osp_nodes} | tr '\n' ',' | sed s/,$//`
+SIM_NODE_LIST=`scontrol show hostname $SLURM_NODELIST | head -n ${NUM_SIM_NODES} | tr '\n' ',' | sed s/,$//`
+
+echo "Sim using $SIM_NODE_LIST"
+echo "OSPRay using $OSPRAY_NODE_LIST"
+
+export SIMULATION_HEAD_NODE=`scontrol show hostname $SLURM_NODELIST | head -n 1`
+export I_MPI_PIN_DOMAIN=node
+
+cd $WORK_DIR
+set -x
+
+for layout in ${LAYOUTS[*]}; do
+  case $layout in
+    treelet*)
+      export PKD_TREELET_DEPTH=${layout#treelet}
+      export PKD_BUCKET_SIZE=0
+      ;;
+    bucket*)
+      export PKD_TREELET_DEPTH=0
+      export PKD_BUCKET_SIZE=${layout#bucket}
+      ;;
+  esac
+  RUN_NAME=${SLURM_JOB_NAME}-${layout}
+
+  echo "Spawning simulation"
+  mpiexec.hydra -n $SIM_RANKS -ppn $SIM_RANKS_PER_NODE -hosts $SIM_NODE_LIST $TEST_SIMULATION \
+    $PARTICLES_PER_SIM_RANK > $OUT_DIR/${RUN_NAME}-sim-log.txt &
+  SIM_PID=$!
+
+  sleep 30
+
+  echo "Launching ospBenchmark with layout $layout"
+  # perf counters are collected per rank, rank 1 is the worker rendering the block
+  mpiexec.hydra -n 2 -ppn 1 -hosts $OSPRAY_NODE_LIST \
+    bash -c "perf stat -e $PERF_EVENTS -o $OUT_DIR/${RUN_NAME}-perf-rank\$PMI_RANK.txt \
+      ./ospBenchmark --module pkd --osp:mpi --script $BENCH_SCRIPT -w 1920 -h 1080" \
+    | tee $OUT_DIR/${RUN_NAME}-ospray-log.txt
+
+  kill $SIM_PID
+  wait $SIM_PID
+done
+
+grep -H "misses" $OUT_DIR/${SLURM_JOB_NAME}-*-perf-rank1.txt
@@ -19,6 +19,24 @@
 #define CORRECT_BOUND_EXTENSION 1
 // If we want to print the total number of particles (including duplicated ghost ones)
 #define PRINT_FULL_PARTICLE_COUNT 0
+// If we want to print the fraction of pkd nodes culled by the attribute culling each frame,
+// counted in ospray/PKDGeometry.ih and printed in ospray/ISPRenderer.cpp
+#define PKD_CULLING_STATS 0
+// If we want to print the lane utilization of the hybrid packet/SPMD pkd traversal each frame,
+// counted in ospray/PKDGeometry.ih and printed in ospray/ISPRenderer.cpp
+#define PKD_LANE_STATS 0
+// Entries in the short stacks of the classic pkd traversal in ospray/TraverseSPMDKernel.ih and
+// ospray/TraversePacketKernel.ih (powers of two). Ancestors whose entries got dropped are recovered
+// from the node IDs, 64 never drops any, which gives the old full stack traversal for comparison
+#define PKD_SPMD_STACK_SIZE 8
+#define PKD_PACKET_STACK_SIZE 16
+// If we want to print the bytes of the compressed block tiles each rank sends each frame, and
+// what they'd take uncompressed, with the isp renderer's compressTiles in ospray/ISPDPRenderTask.cpp
+#define ISP_TILE_STATS 0
+// Cells per axis of the optional occupancy grid over each block's tight bounds, built in
+// ospray/InSituSpheres.cpp and used to clip rays in ospray/ISPRenderer.ispc. The grid is
+// a 64 bit mask, so at most 4
+#define BLOCK_OCCUPANCY_RES 4
 
 // Toggle to enable/disable the simulation using the insitu library
 #define OSP_IS_ENABLED 1